@@ -0,0 +1,48 @@
+#ifndef CANCEL_HPP
+#define CANCEL_HPP
+
+#include <atomic>
+#include <exception>
+#include <memory>
+
+namespace ThreadPool {
+
+  // Cancelled
+  //
+  // Exception received through the future of a task that was dropped
+  // before it started, see CancelToken and Pool::cancel_pending().
+  struct Cancelled : std::exception {
+    const char* what () const noexcept override {return "task cancelled";}
+  };
+
+  // CancelToken
+  //
+  // Shared flag to abandon a set of tasks, e.g.
+  //   CancelToken token;
+  //   auto result = pool.execute(token, [token]() {
+  //     while (!token.cancelled())
+  //       refine();
+  //   });
+  //   token.cancel();
+  // Tasks submitted with a token that is cancelled before they start are
+  // dropped (their futures get Cancelled), those already running may poll
+  // it to stop early.  Copies of a token share the same flag.
+  class CancelToken {
+   public:
+    CancelToken () : flag{std::make_shared<std::atomic<bool>>(false)} {}
+
+    // cancel every task holding this token (or a copy of it)
+    inline void cancel    () const {flag->store(true);}
+
+    // returns true if the token was cancelled
+    inline bool cancelled () const {
+      return flag->load(std::memory_order_relaxed);
+    }
+
+   private:
+    std::shared_ptr<std::atomic<bool>> flag;  // shared by all copies
+  };
+
+}
+
+#endif
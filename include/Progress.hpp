@@ -1,7 +1,10 @@
 #ifndef PROGRESS_HPP
 #define PROGRESS_HPP
 
+#include <atomic>
 #include <ostream>
+#include <string>
+#include <vector>
 
 namespace Progress {
 
@@ -13,35 +16,109 @@ namespace Progress {
   // Returns the output stream so a message can be appended to it
   std::ostream& Bar (double fraction, int width=40);
 
+  // Bar (line, fraction, width)
+  //
+  // Same as above, but append the progress bar to a string instead.
+  //   line     :string the bar is appended to
+  //   fraction :[0.0, 1.0] filled fraction of the bar
+  //   width    :number of characters occupied by the bar
+  void Bar (std::string &line, double fraction, int width=40);
+
+  // Screen
+  //
+  // Draws frames (a block of lines) in place on a terminal.  Each frame is
+  // built in a reusable buffer and sent with a single write(), and only the
+  // lines that changed since the previous frame are rewritten.  The cursor
+  // is left at the beginning of the first line between frames.
+  class Screen {
+   public:
+    // constructs a screen writing to the given file descriptor
+    Screen(int fd = 1) : fd{fd}, nlines{0}, rows{0}, written{0}, writes{0} {}
+
+    // add a new line to the current frame and return it to be filled
+    std::string& line  ();
+
+    // add raw output (e.g. escape sequences) to be sent with next frame
+    void         raw   (std::string_view sequence);
+
+    // send the changes of the current frame to the terminal
+    void         draw  ();
+
+    // move the cursor to the line after the frame and forget all lines
+    void         close ();
+
+    // total number of bytes and of write() calls done so far
+    inline size_t bytes () const {return written;}
+    inline size_t calls () const {return writes;}
+
+   private:
+    // write the whole buffer to the file descriptor and clear it
+    void flush ();
+
+    int                      fd;        // where to draw
+    std::vector<std::string> lines;     // current (and previous) frame
+    std::vector<std::string> previous;  // what is shown on each row
+    size_t                   nlines;    // number of lines in current frame
+    size_t                   rows;      // number of rows used on screen
+    std::string              buffer;    // output of the frame
+    size_t                   written;   // count bytes written
+    size_t                   writes;    // count write() calls
+  };
+
   // Counter
   //
   // Implements a simple integer counter towards a determined number of total
   // steps.  This class is mainly used for implementing implicit conversion
   // to a real number between 0 and 1, suitable for calling 'Bar()' from
-  // within a loop.
+  // within a loop.  Count and total are relaxed atomics: the counter is
+  // meant to be incremented by a single thread while others may read it at
+  // any time, so '++' costs about as much as incrementing a local variable.
   class Counter {
    public:
     // constructs an object given the expected number of total steps
-    Counter(long steps = 1) : count{0}, step{1./steps} {}
+    Counter(long steps = 1) : count{0}, total{steps} {}
 
     // implicit conversion to real number of 'count / total'
-    inline operator double      () const {return count*step;}
+    inline operator double      () const {return count_() * get_step();}
 
     // returns true if the counter hasn't reached the total
-    inline operator bool        () const {return operator double() < 1.0;}
+    inline operator bool        () const {return count_() < total_();}
+
+    // increments the counter towards the total (single writer only)
+    inline Counter& operator++  ()       {
+      count.store(count_() + 1, std::memory_order_relaxed);
+      return *this;
+    }
 
-    // increments the counter towards the total
-    inline Counter& operator++  ()       {++count; return *this;}
+    // increments the counter by n (safe with any number of writers)
+    inline void     advance     (long n=1) {
+      count.fetch_add(n, std::memory_order_relaxed);
+    }
 
-    // increments the total number of steps
-    inline void     add_step    ()       {step /= 1.0 + step;}
+    // increments the total number of steps by n
+    inline void     add_step    (long n=1) {
+      total.fetch_add(n, std::memory_order_relaxed);
+    }
 
     // get the current weight of a single step: '1.0 / total'
-    inline double   get_step    () const {return step;}
+    inline double   get_step    () const {return 1.0 / total_();}
+
+    // get the number of steps counted and the total number of steps
+    inline long     get_count   () const {return count_();}
+    inline long     get_total   () const {return total_();}
+
+    // start over counting towards a new number of total steps
+    inline void     reset       (long steps = 1) {
+      total.store(steps, std::memory_order_relaxed);
+      count.store(0, std::memory_order_relaxed);
+    }
 
    private:
-    long   count;  // current count
-    double step;   // weight of a single step: '1.0 / total'
+    inline long count_ () const {return count.load(std::memory_order_relaxed);}
+    inline long total_ () const {return total.load(std::memory_order_relaxed);}
+
+    std::atomic<long> count;  // current count
+    std::atomic<long> total;  // total number of steps
   };
 
 }
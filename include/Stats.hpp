@@ -0,0 +1,79 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Times of tasks and workers (Pool::enable_stats()) can be compiled out by
+// defining THREADPOOL_STATS as 0, e.g. with -DTHREADPOOL_STATS=0
+#ifndef THREADPOOL_STATS
+#define THREADPOOL_STATS 1
+#endif
+
+namespace ThreadPool {
+
+  // whether pools are built able to measure times at all
+  inline constexpr bool timed_stats = THREADPOOL_STATS;
+
+  // Histogram
+  //
+  // Histogram of durations with power of 2 buckets: bucket i counts the
+  // durations in [2^i, 2^(i+1)) nanoseconds (and bucket 0 also counts 0).
+  struct Histogram {
+    static constexpr size_t nbuckets = 40;  // up to 2^40 ns, about 18 min
+
+    std::array<uint64_t, nbuckets> buckets{};
+
+    // bucket of a duration in nanoseconds
+    static constexpr size_t bucket (uint64_t ns) {
+      return std::min<size_t>(std::max(1, int(std::bit_width(ns))) - 1,
+                              nbuckets - 1);
+    }
+
+    // total number of durations counted
+    uint64_t count () const {
+      uint64_t n{0};
+      for (auto b : buckets)
+        n += b;
+      return n;
+    }
+
+    // upper bound (in nanoseconds) of the given percentile p in [0, 1]
+    double percentile (double p) const {
+      uint64_t n = count(), seen{0};
+      for (size_t i{0}; i < nbuckets; ++i)
+        if ((seen += buckets[i]) > 0 && seen >= p * n)
+          return double(uint64_t{2} << i);
+      return 0;
+    }
+  };
+
+  // Stats
+  //
+  // Snapshot of the statistics of a pool, see Pool::stats().
+  struct Stats {
+    using seconds = std::chrono::duration<double>;
+
+    struct Worker {
+      uint64_t tasks;      // number of tasks executed
+      uint64_t steals;     // number of tasks stolen from other workers
+      seconds  busy;       // time spent executing tasks
+      seconds  idle;       // time spent sleeping, waiting for tasks
+    };
+
+    std::vector<Worker> workers;    // statistics of each worker
+    Histogram           wait;       // time tasks waited in queue to start
+    Histogram           run;        // time tasks took to execute
+    uint64_t            contended;  // times a lock was already taken
+    uint64_t            helped;     // tasks run by threads outside the pool
+    seconds             helping;    // time they spent executing those tasks
+  };
+
+}
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef TASK_HPP
+#define TASK_HPP
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace ThreadPool {
+
+  // Task
+  //
+  // Move-only, type-erased holder of any callable 'function()'.  Unlike
+  // std::function it doesn't require the callable to be copyable and, for
+  // callables small enough (up to 'capacity' bytes, i.e. most lambdas), it
+  // stores them inline so that creating, moving and running a task never
+  // touches the heap.  Larger callables are allocated once at construction.
+  class Task {
+   public:
+    // bytes available for inline storage: the whole task fits a cache line
+    static constexpr size_t capacity = 64 - sizeof(void*);
+
+    // empty task, calling it is undefined
+    Task () noexcept : ops{nullptr} {}
+
+    // construct a task from any callable that is not a task itself
+    template<typename F, typename=std::enable_if_t<
+      !std::is_same_v<std::decay_t<F>, Task> &&
+      std::is_invocable_v<std::decay_t<F>&>>>
+    Task (F &&function);
+
+    // tasks can be moved around, but never copied
+    Task (Task &&other) noexcept : ops{other.ops} {
+      if (ops)
+        ops->move(storage, other.storage);
+      other.ops = nullptr;
+    }
+
+    Task& operator= (Task &&other) noexcept {
+      if (this != &other) {
+        reset();
+        if ((ops = other.ops))
+          ops->move(storage, other.storage);
+        other.ops = nullptr;
+      }
+      return *this;
+    }
+
+    Task (Task const &)            = delete;
+    Task& operator= (Task const &) = delete;
+
+    ~Task () {reset();}
+
+    // execute the stored callable
+    inline void operator() ()             {ops->call(storage);}
+
+    // returns true if there is a callable stored
+    inline explicit operator bool () const {return ops;}
+
+    // destroy the stored callable (if any) leaving the task empty
+    inline void reset () {
+      if (ops)
+        ops->destroy(storage);
+      ops = nullptr;
+    }
+
+   private:
+    // table of operations for a given stored type
+    struct Ops {
+      void (*call)    (void *self);
+      void (*move)    (void *self, void *other);
+      void (*destroy) (void *self);
+    };
+
+    // whether callable type F can be stored inline
+    template<typename F>
+    static constexpr bool is_inline =
+      sizeof(F) <= capacity && alignof(F) <= alignof(std::max_align_t) &&
+      std::is_nothrow_move_constructible_v<F>;
+
+    // operations when F is stored inline
+    template<typename F>
+    static constexpr Ops inline_ops {
+      [](void *self) {(*std::launder(static_cast<F*>(self)))();},
+      [](void *self, void *other) {
+        auto &from = *std::launder(static_cast<F*>(other));
+        ::new (self) F(std::move(from));
+        from.~F();
+      },
+      [](void *self) {std::launder(static_cast<F*>(self))->~F();},
+    };
+
+    // operations when F is stored in the heap (only a pointer is inline)
+    template<typename F>
+    static constexpr Ops heap_ops {
+      [](void *self) {(**static_cast<F**>(self))();},
+      [](void *self, void *other) {
+        *static_cast<F**>(self) = *static_cast<F**>(other);
+      },
+      [](void *self) {delete *static_cast<F**>(self);},
+    };
+
+    alignas(std::max_align_t) unsigned char storage[capacity];
+    Ops const *ops;  // operations for the stored type (null if empty)
+  };
+
+  template<typename F, typename>
+  Task::Task(F &&function) {
+    using type = std::decay_t<F>;
+    if constexpr (is_inline<type>) {
+      ::new (static_cast<void*>(storage)) type(std::forward<F>(function));
+      ops = &inline_ops<type>;
+    }
+    else {
+      *reinterpret_cast<type**>(storage) = new type(std::forward<F>(function));
+      ops = &heap_ops<type>;
+    }
+  }
+
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef TASKQUEUE_HPP
+#define TASKQUEUE_HPP
+
+#include <chrono>
+#include <memory>
+#include "Task.hpp"
+
+namespace ThreadPool {
+
+  // Job
+  //
+  // Entry of a TaskQueue: the task itself plus the bookkeeping that the
+  // pool keeps about it.
+  struct Job {
+    using time_point = std::chrono::steady_clock::time_point;
+
+    Task       task;    // what is going to be executed
+    size_t     weight;  // number of tasks it accounts for in the pool hooks
+    time_point queued;  // when it was queued (only if the pool measures it)
+  };
+
+  // TaskQueue
+  //
+  // Double-ended queue of tasks implemented as a ring buffer.  Contrary to
+  // std::deque, which allocates and frees a block every few elements as the
+  // queue slides, the buffer only grows (doubling its size) and is reused
+  // forever, so a queue in a steady state never allocates.
+  class TaskQueue {
+   public:
+    TaskQueue () : head{0}, tail{0}, mask{0} {}
+
+    // number of tasks in the queue
+    inline size_t size  () const {return tail - head;}
+
+    // returns true if there are no tasks in the queue
+    inline bool   empty () const {return head == tail;}
+
+    // add a job to the back of the queue
+    inline void push_back (Job &&job) {
+      if (size() == capacity())
+        grow();
+      buffer[tail++ & mask] = std::move(job);
+    }
+
+    // remove the job from the back of the queue (newest)
+    inline Job  pop_back  () {return std::move(buffer[--tail & mask]);}
+
+    // remove the job from the front of the queue (oldest)
+    inline Job  pop_front () {return std::move(buffer[head++ & mask]);}
+
+   private:
+    inline size_t capacity () const {return buffer ? mask + 1 : 0;}
+
+    // double the capacity, moving the tasks to the beginning of new buffer
+    void grow () {
+      size_t n = capacity() ? 2*capacity() : 16;
+      auto bigger = std::make_unique<Job[]>(n);
+      for (size_t i{0}; head + i != tail; ++i)
+        bigger[i] = std::move(buffer[(head + i) & mask]);
+      tail   = size();
+      head   = 0;
+      mask   = n - 1;
+      buffer = std::move(bigger);
+    }
+
+    std::unique_ptr<Job[]>  buffer;  // ring buffer with power of 2 size
+    size_t                  head;    // index of the front (oldest)
+    size_t                  tail;    // index after the back (newest)
+    size_t                  mask;    // size of buffer - 1
+  };
+
+}
+
+#endif
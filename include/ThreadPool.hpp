@@ -1,18 +1,117 @@
 #ifndef THREADPOOL_HPP
 #define THREADPOOL_HPP
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <functional>
 #include <future>
-#include <queue>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <tuple>
 #include <vector>
+#include "Cancel.hpp"
+#include "Stats.hpp"
+#include "Task.hpp"
+#include "TaskQueue.hpp"
+#include "TimerWheel.hpp"
+#include "Topology.hpp"
 
 namespace ThreadPool {
 
+  // Schedule
+  //
+  // How parallel_for() and parallel_reduce() split a range of indices into
+  // chunks that are handed out to the threads:
+  //   Static   :one equal chunk per thread (or chunks of a given size)
+  //   Dynamic  :many small chunks of equal size, taken one at a time
+  //   Guided   :large chunks at first which shrink as the range is consumed
+  enum class Schedule {Static, Dynamic, Guided};
+
+  // Priority
+  //
+  // Level at which a task is queued, workers always look for work at the
+  // higher levels first:
+  //   High       :latency-sensitive tasks that should jump the queue
+  //   Normal     :default level of every task
+  //   Background :bulk work that runs when nothing else is waiting
+  // Lower levels are not starved though, every few tasks a busy worker
+  // gives a turn to the normal (1 in 4) or background (1 in 16) levels.
+  enum class Priority {High, Normal, Background};
+
+  // Shutdown
+  //
+  // What happens to the tasks still queued when a pool is shut down:
+  //   Drain    :they all run, as well as any task they queue in turn
+  //   Discard  :they are dropped (futures get Cancelled), only the tasks
+  //             already running are waited for
+  enum class Shutdown {Drain, Discard};
+
+  // Overflow
+  //
+  // What submitting tasks from outside the pool does when its queue is
+  // full, see Pool::set_capacity():
+  //   Block  :wait until workers make room for them
+  //   Fail   :throw QueueFull
+  //   Run    :run them right away on the calling thread
+  enum class Overflow {Block, Fail, Run};
+
+  // QueueFull
+  //
+  // Exception thrown when submitting to a full queue with Overflow::Fail.
+  struct QueueFull : std::exception {
+    const char* what () const noexcept override {return "task queue full";}
+  };
+
+  // NoHooks
+  //
+  // Observer of a pool that does nothing, see Pool::observe().  Any class
+  // with these two members can observe a pool: enqueued(n) is called after
+  // n tasks are queued and dequeued(n) after n tasks are finished (or
+  // dropped).  Without an observer, the pool only checks a flag per task.
+  struct NoHooks {
+    void enqueued (size_t) {}
+    void dequeued (size_t) {}
+  };
+
+  // Idle
+  //
+  // What a worker does when it runs out of tasks: it looks for new ones
+  // 'spins' times in a busy loop, then 'yields' times giving up its time
+  // slice, and only then goes to sleep.  A worker that hasn't gone to sleep
+  // yet starts the next task sooner and without any system call, but burns
+  // cpu while there is nothing to do.
+  struct Idle {
+    size_t spins  = 256;  // checks in a busy loop (with a pause each)
+    size_t yields = 0;    // checks yielding to other threads
+  };
+
+  // Elastic
+  //
+  // Bounds of a pool whose number of threads follows the load.  It starts
+  // with 'min' threads and adds one more (up to 'max') whenever tasks wait
+  // in queue for longer than 'wait'.  Threads idle for longer than 'idle'
+  // retire one at a time, the last one started first, down to 'min'.
+  struct Elastic {
+    size_t                    min;          // threads always running
+    size_t                    max;          // threads running at most
+    std::chrono::microseconds wait = std::chrono::milliseconds{1};
+    std::chrono::milliseconds idle = std::chrono::seconds{5};
+  };
+
   // Pool
   //
-  // Simple canonical implementation of a thread pool.  Threads are setup at
-  // construction and tasks are later dynamically created and added to a
-  // queue. Idle threads get the first available task and execute it before
-  // waiting for a new one.
+  // Work-stealing implementation of a thread pool.  Threads are setup at
+  // construction and each one owns a local queue of tasks.  Tasks created
+  // from inside a worker go to that worker's own queue, while tasks created
+  // from outside are spread among the workers, where they run in the order
+  // they were submitted.  A worker runs its own most recent task first and,
+  // when it runs out of work, steals the oldest task from another worker
+  // before going to sleep.  Workers may be pinned to cpus, see Affinity.
   class Pool {
    private:
     using thread = std::thread;
@@ -21,20 +120,126 @@ namespace ThreadPool {
     template<typename ...T>
     using IsInvocable = std::enable_if_t<std::is_invocable_v<T&&...>>;
 
-    // generic type for any task
-    template<typename T=void>
-    using Task = std::packaged_task<T()>;
-
    public:
     // construct a pool with given number of threads (defaults to hardware)
-    Pool(size_t nthreads=std::max(1u, thread::hardware_concurrency()));
+    // placed on the cpus according to affinity (by default not pinned)
+    Pool(size_t nthreads=std::max(1u, thread::hardware_concurrency()),
+         Affinity affinity={});
+
+    // construct a pool whose number of threads changes within bounds
+    Pool(Elastic bounds, Affinity affinity={});
 
-    // destructor needs to wait/cleanup threads
+    // destructor drains the pool (unless already shut down) and cleans up
+    // the threads
     ~Pool();
 
-    // wait until all threads are idle and there are no more tasks in queue
+    // shutdown (mode)
+    //
+    // Stop the pool after dealing with the queued tasks according to mode
+    // and join the threads.  Tasks submitted afterwards are dropped right
+    // away, their futures get Cancelled.
+    void shutdown (Shutdown mode=Shutdown::Drain);
+
+    // cancel_pending () -> number of tasks dropped
+    //
+    // Drop every task still queued, the running ones are left alone.  The
+    // futures of dropped tasks get Cancelled and the dequeue hook counts
+    // them as finished, so the bars still reach their total.
+    size_t cancel_pending ();
+
+    // wait ()
+    //
+    // Wait until all threads are idle and there are no more tasks in queue,
+    // running queued tasks on the calling thread meanwhile.  From inside a
+    // task it waits for every other task (except those waiting as well),
+    // so nested fork/join is fine.
     void wait ();
 
+    // wait (future)
+    //
+    // Wait until the future (or shared_future) is ready, running queued
+    // tasks on the calling thread meanwhile, so a task may wait for another
+    // without holding up a worker.
+    template<typename F, typename=decltype(
+      std::declval<F const&>().wait_for(std::chrono::seconds{}))>
+    void wait (F const &future);
+
+    // help () -> whether a task was run
+    //
+    // Run one queued task on the calling thread, if there is any.
+    bool help ();
+
+    // wait_until (lock, done, sleep)
+    //
+    // Wait until done() holds, running queued tasks on the calling thread
+    // meanwhile (with 'lock' released), so that a worker never blocks and
+    // waits nest.  done() is checked with 'lock' held and, when there is
+    // nothing to run, sleep(pause) waits for it at most that long, pause
+    // growing from 1us up to 1ms while there is still nothing to run.
+    template<typename P, typename S>
+    void wait_until (std::unique_lock<std::mutex> &lock, P const &done,
+                     S const &sleep);
+
+    // number of worker threads in the pool (at most, if elastic)
+    inline size_t size () const {return workers.size();}
+
+    // number of worker threads running right now, workers [0, active)
+    inline size_t active () const {return live;}
+
+    // generation (index) -> number of threads that have been worker 'index'
+    //
+    // It changes whenever a retired worker is replaced by a new thread.
+    inline size_t generation (size_t index) const {
+      return workers[index]->generation;
+    }
+
+    // index [0, size) of the calling thread in the pool, -1 if not a worker
+    long thread_index () const;
+
+    // number of tasks (of any pool) the calling thread is running, counting
+    // those it runs while waiting inside another one: 0 outside of tasks
+    static size_t depth ();
+
+    // enable_stats (on)
+    //
+    // Start/stop measuring how long tasks wait in queue and take to run, as
+    // well as busy and idle time of each worker: it costs two clock reads
+    // per task and one per batch queued.  Disabled, a task costs a relaxed
+    // load of the flag, and nothing at all when compiled with
+    // THREADPOOL_STATS=0 (where this does nothing).  Tasks, steals and lock
+    // contention are always counted, a relaxed add to a counter per task.
+    inline void enable_stats (bool on=true) {measuring = on;}
+
+    // set_idle (policy)
+    //
+    // Set how workers wait for tasks before going to sleep, see Idle.
+    inline void set_idle (Idle policy) {
+      idling.spins  = policy.spins;
+      idling.yields = policy.yields;
+    }
+
+    // set_capacity (limit, policy)
+    //
+    // Bound the number of queued tasks (0 for no bound, the default) so that
+    // producers can't get too far ahead of the workers
+    //   limit      :most tasks waiting in queue, of all levels together
+    //   policy     :what submitting to a full queue does
+    // Only tasks submitted from outside the pool are held back, tasks
+    // queued from inside a task always get in so that workers never block.
+    // A batch gets in whole if the queue isn't full yet.
+    inline void set_capacity (size_t limit, Overflow policy=Overflow::Block) {
+      overflow = policy;
+      capacity = limit;
+      // blocked producers check again against the new limit
+      pending.notify_all();
+    }
+
+    // stats () -> snapshot
+    //
+    // Get a snapshot of the statistics of the pool so far.  It can be taken
+    // at any time from any thread, it doesn't lock nor disturb workers.
+    Stats stats () const;
+
     // execute (function(), ...args) -> future
     //
     // Create a new task to the pool that will execute function(args)
@@ -42,7 +247,232 @@ namespace ThreadPool {
     //   args       :list of arguments to be passed to the function
     // It returns a future of the same return type as function's
     template<typename R, typename ...A, typename=IsInvocable<R, A...>>
-    auto execute(R &&function, A &&...args);
+    auto execute(R &&function, A &&...args) {
+      return execute(Priority::Normal, std::forward<R>(function),
+                     std::forward<A>(args)...);
+    }
+
+    // same as above at the given priority level
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    auto execute(Priority priority, R &&function, A &&...args);
+
+    // try_execute (function(), ...args) -> future, if any
+    //
+    // Same as execute(), but it never blocks: if the queue is full (see
+    // set_capacity()) nothing is queued and it returns an empty optional
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    auto try_execute(R &&function, A &&...args) {
+      return try_execute(Priority::Normal, std::forward<R>(function),
+                         std::forward<A>(args)...);
+    }
+
+    // same as above at the given priority level
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    auto try_execute(Priority priority, R &&function, A &&...args);
+
+    // execute (token, function(), ...args) -> future
+    //
+    // Same as execute(), but the task is dropped if the token is cancelled
+    // before it starts: function is not called and the future gets
+    // Cancelled.  A running task may poll the token to stop early.
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    auto execute(CancelToken const &token, R &&function, A &&...args) {
+      return execute(Priority::Normal, token, std::forward<R>(function),
+                     std::forward<A>(args)...);
+    }
+
+    // same as above at the given priority level
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    auto execute(Priority priority, CancelToken const &token, R &&function,
+                 A &&...args);
+
+    // post (function(), ...args)
+    //
+    // Create a new task to the pool that will execute function(args)
+    //   function   :reference to the function to be called
+    //   args       :list of arguments to be passed to the function
+    // Fire and forget version of execute(): there is no future and the
+    // result (or exception) of the function is discarded, so small tasks
+    // don't need any memory allocation at all.
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    void post(R &&function, A &&...args) {
+      post(Priority::Normal, std::forward<R>(function),
+           std::forward<A>(args)...);
+    }
+
+    // same as above at the given priority level
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    void post(Priority priority, R &&function, A &&...args);
+
+    // post (token, function(), ...args)
+    //
+    // Fire and forget version of execute(token, ...), see post()
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    void post(CancelToken const &token, R &&function, A &&...args) {
+      post(Priority::Normal, token, std::forward<R>(function),
+           std::forward<A>(args)...);
+    }
+
+    // same as above at the given priority level
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    void post(Priority priority, CancelToken const &token, R &&function,
+              A &&...args);
+
+    // execute_after (delay, function(), ...args) -> future
+    //
+    // Same as execute(), but the task is queued once the delay has passed.
+    // Waiting tasks are kept in a timer wheel with a resolution of 1ms,
+    // serviced by the workers themselves: an idle worker sleeps until the
+    // next one is due, busy workers check between tasks.  Pool::wait()
+    // doesn't wait for tasks that are not due yet, and shutdown() drops
+    // them (their futures get Cancelled).
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    auto execute_after(std::chrono::steady_clock::duration delay,
+                       R &&function, A &&...args);
+
+    // execute_every (period, function(), ...args) -> token
+    //
+    // Queue a task executing function(args) once every period, the first
+    // one a period from now, until the returned token is cancelled (or the
+    // pool shuts down).  A run never overlaps the previous one: when a run
+    // takes longer than the period, the runs missed meanwhile are skipped.
+    // Exceptions thrown by function are discarded, see post().
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    CancelToken execute_every(std::chrono::steady_clock::duration period,
+                              R &&function, A &&...args);
+
+    // execute_batch (first, last, function()) -> futures
+    //
+    // Create one task per element in [first, last) executing function(*it)
+    //   first      :iterator to the first element
+    //   last       :iterator past the last element
+    //   function   :function to be called for every element
+    // It returns a list of futures of the same return type as function's
+    // All tasks are added at once: the queue is locked once, the enqueue
+    // hook runs once with the number of tasks and only as many threads as
+    // needed are woken up.  The elements are accessed only when the task
+    // runs, so the range must outlive the tasks.
+    template<typename I, typename R, typename=IsInvocable<R,
+      std::iter_reference_t<I>>>
+    auto execute_batch(I first, I last, R &&function) {
+      return execute_batch(Priority::Normal, first, last,
+                           std::forward<R>(function));
+    }
+
+    // same as above at the given priority level
+    template<typename I, typename R, typename=IsInvocable<R,
+      std::iter_reference_t<I>>>
+    auto execute_batch(Priority priority, I first, I last, R &&function);
+
+    // same as above for a whole range, e.g. execute_batch(vector, function)
+    template<std::ranges::range V, typename R, typename=IsInvocable<R,
+      std::ranges::range_reference_t<V>>>
+    auto execute_batch(V &&range, R &&function) {
+      return execute_batch(Priority::Normal, std::forward<V>(range),
+                           std::forward<R>(function));
+    }
+
+    template<std::ranges::range V, typename R, typename=IsInvocable<R,
+      std::ranges::range_reference_t<V>>>
+    auto execute_batch(Priority priority, V &&range, R &&function) {
+      return execute_batch(priority, std::ranges::begin(range),
+                           std::ranges::end(range), std::forward<R>(function));
+    }
+
+    // post_batch (first, last, function())
+    //
+    // Fire and forget version of execute_batch(), see post()
+    template<typename I, typename R, typename=IsInvocable<R,
+      std::iter_reference_t<I>>>
+    void post_batch(I first, I last, R &&function) {
+      post_batch(Priority::Normal, first, last, std::forward<R>(function));
+    }
+
+    // same as above at the given priority level
+    template<typename I, typename R, typename=IsInvocable<R,
+      std::iter_reference_t<I>>>
+    void post_batch(Priority priority, I first, I last, R &&function);
+
+    // same as above for a whole range, e.g. post_batch(vector, function)
+    template<std::ranges::range V, typename R, typename=IsInvocable<R,
+      std::ranges::range_reference_t<V>>>
+    void post_batch(V &&range, R &&function) {
+      post_batch(Priority::Normal, std::forward<V>(range),
+                 std::forward<R>(function));
+    }
+
+    template<std::ranges::range V, typename R, typename=IsInvocable<R,
+      std::ranges::range_reference_t<V>>>
+    void post_batch(Priority priority, V &&range, R &&function) {
+      post_batch(priority, std::ranges::begin(range), std::ranges::end(range),
+                 std::forward<R>(function));
+    }
+
+    // parallel_for (begin, end, function(), schedule, chunk)
+    //
+    // Execute function(b, e) for consecutive chunks [b, e) covering exactly
+    // the whole range [begin, end), blocking until all chunks are done.
+    //   begin      :first index of the range
+    //   end        :index past the last one of the range
+    //   function   :function called for every chunk
+    //   schedule   :how the range is split into chunks
+    //   chunk      :chunk size (minimum size if Guided), 0 for automatic
+    // The calling thread works on the chunks as well, so it can be called
+    // from inside a task without the risk of a deadlock.  Each chunk counts
+    // as a task for the enqueue/dequeue hooks, i.e. for the bars' progress.
+    // Helpers are queued at the priority of the calling task (if any).
+    // If function throws, the first exception is rethrown at the end.
+    template<typename R, typename=IsInvocable<R, long, long>>
+    void parallel_for(long begin, long end, R &&function,
+                      Schedule schedule=Schedule::Guided, long chunk=0);
+
+    // parallel_reduce (begin, end, init, map(), reduce(), ...) -> value
+    //
+    // Combine the values of map(b, e) for every chunk [b, e) of the range
+    // [begin, end) using reduce(value, value) starting from value 'init'.
+    //   begin      :first index of the range
+    //   end        :index past the last one of the range
+    //   init       :initial value (identity element of reduce)
+    //   map        :function that computes the value of a chunk
+    //   reduce     :associative and commutative function combining values
+    //   schedule   :how the range is split into chunks
+    //   chunk      :chunk size (minimum size if Guided), 0 for automatic
+    // Chunks are combined in order of completion, see parallel_for().
+    template<typename T, typename M, typename R,
+      typename=IsInvocable<M, long, long>, typename=IsInvocable<R, T, T>>
+    T parallel_reduce(long begin, long end, T init, M &&map, R &&reduce,
+                      Schedule schedule=Schedule::Guided, long chunk=0);
+
+    // schedule (priority) -> awaitable
+    //
+    // Move a coroutine to the pool: 'co_await pool.schedule()' suspends the
+    // calling coroutine and resumes it as a new task on one of the workers,
+    // at the given priority level (see Coroutine<T> and spawn()).  If the
+    // task is dropped, e.g. by cancel_pending(), the coroutine is resumed
+    // anyway but 'co_await' throws Cancelled.
+    auto schedule (Priority priority=Priority::Normal) {
+      struct Awaiter {
+        Pool     &pool;
+        Priority  priority;
+        bool      dropped{false};
+
+        bool await_ready   () const noexcept {return false;}
+        void await_resume  () const {
+          if (dropped)
+            throw Cancelled{};
+        }
+        void await_suspend (std::coroutine_handle<> handle) {
+          pool.enqueue(priority, [this, handle]() {
+            // the coroutine itself runs as usual, whatever it does next
+            bool outer = std::exchange(discarding, false);
+            dropped = outer;
+            handle.resume();
+            discarding = outer;
+          });
+        }
+      };
+      return Awaiter{*this, priority};
+    }
 
     // split (function(), n, ...args) -> future
     //
@@ -57,33 +487,287 @@ namespace ThreadPool {
     template<typename R, typename ...A, typename=IsInvocable<R, long, A...>>
     auto split(R &&function, long n, A &&...args);
 
-    // set_hook_(en|de)queue (function())
+    // observe (hooks)
     //
-    // Set function() to be executed when enqueueing/dequeueing new tasks.
-    inline void set_enqueue(std::function<void()> f=0) {hook_enqueue = f;}
-    inline void set_dequeue(std::function<void()> f=0) {
-      // dequeue hook is executed by every thread, so protect it
-      std::unique_lock _{queue_lock};
-      hook_dequeue = f;
-    }
+    // Call hooks->enqueued(n) after enqueueing n tasks and hooks->dequeued(n)
+    // after n tasks are finished, see NoHooks.  The calls are bound at
+    // compile time (no std::function) and made without any lock of the
+    // pool, by every thread at once.  Observing nothing (or NoHooks) removes
+    // the observer, returning once no thread is calling it anymore.
+    template<typename H=NoHooks>
+    void observe (H *hooks=nullptr);
 
    private:
-    // internal method that adds task to the pool
-    template<typename T>
-    auto enqueue(T &&task);
+    // graphs and groups queue their tasks directly, see discard()
+    friend class Graph;
+    friend class TaskGroup;
+    template<typename> friend class Channel;
+
+    // Range
+    //
+    // Range of indices split into chunks according to a schedule, chunks
+    // are claimed by many threads at once without locking.
+    class Range {
+     public:
+      // parameters defining a range: begin, end, schedule, chunk, nthreads
+      using Args = std::tuple<long, long, Schedule, long, size_t>;
+
+      Range(Args args);
 
-    bool                      done;             // whether finished tasks
-    size_t                    processing;       // count working threads
+      // claim next chunk [begin, end), returns false if there is none
+      bool   next   (long &begin, long &end);
+
+      // total number of chunks the range is split into
+      size_t chunks () const;
+
+     private:
+      // size of the chunk starting at given position
+      long   length (long position) const;
+
+      std::atomic<long> position;   // beginning of the next chunk
+      long              last;       // end of the range
+      long              chunk;      // (minimum) size of the chunks
+      long              nthreads;   // number of threads sharing the range
+      Schedule          schedule;   // how the range is split
+    };
+
+    // Loop
+    //
+    // State of a running parallel_for(), shared with the helper tasks.
+    // Helper tasks may start after the loop has finished, so they own it
+    // and touch the function only after successfully claiming a chunk.
+    struct Loop {
+      Loop(Range::Args args, std::function<void(long, long)> const &fn)
+          : range{args}, chunks{range.chunks()}, done{0}, function{&fn}
+          , failed{false} {}
+
+      Range                range;   // chunks still to be claimed
+      size_t               chunks;  // total number of chunks
+      std::atomic<size_t>  done;    // number of finished chunks
+      std::function<void(long, long)> const *function;  // chunk body
+      std::atomic<bool>    failed;  // whether function has thrown
+      std::mutex           lock;    // guard the exception
+      std::exception_ptr   error;   // first exception thrown by function
+    };
+
+    // execute loop with the help of the workers and wait until it's done
+    void for_each_chunk (Range::Args range,
+                         std::function<void(long, long)> const &function);
+
+    // execute chunks of the loop until there are no more left
+    void work           (Loop &loop);
+
+    // Counters
+    //
+    // Statistics of a worker thread, in nanoseconds where applicable.  Only
+    // the worker writes to them (except for contention of its lock), anyone
+    // may read them at any time.  Threads outside the pool running its
+    // tasks share one more set, which they add to atomically.
+    struct alignas(64) Counters {
+      using Buckets = std::array<std::atomic<uint64_t>, Histogram::nbuckets>;
+
+      std::atomic<uint64_t> tasks{0};      // number of tasks executed
+      std::atomic<uint64_t> steals{0};     // number of tasks stolen
+      std::atomic<uint64_t> busy{0};       // time executing tasks
+      std::atomic<uint64_t> idle{0};       // time sleeping
+      std::atomic<uint64_t> contended{0};  // times lock was already taken
+      Buckets               wait{};        // histogram of time in queue
+      Buckets               run{};         // histogram of time running
+    };
+
+    // number of priority levels
+    static constexpr size_t levels = 3;
+
+    // Worker
+    //
+    // Local queues of a worker thread, one per priority level.  The owner
+    // pushes and pops its own tasks at the back, so recently created (and
+    // still cached) work runs first, while thieves take tasks from the
+    // front.  Tasks from outside the pool go to a separate inbox and always
+    // run oldest first.  Aligned to a cache line so that neighbouring
+    // workers don't share their locks.
+    struct alignas(64) Worker {
+      std::mutex          lock;     // guard the local queues
+      std::array<TaskQueue, levels> tasks; // tasks queued by the owner
+      std::array<TaskQueue, levels> inbox; // tasks from outside, in order
+      size_t              turn{0};  // number of pops (only used by owner)
+      bool                alive{false}; // whether a thread is running it
+      std::atomic<size_t> generation{0}; // threads that have run it
+      int                 cpu{-1};  // cpu it is pinned to (-1 if not)
+      int                 node{0};  // NUMA node of its cpu
+      std::vector<size_t> victims;  // workers to steal from, nearest first
+      Counters            counters; // statistics of this worker
+      std::atomic<size_t> hooking{0}; // whether calling the observer
+    };
+
+    // couple function and arguments in a task with a future
+    template<typename R, typename ...A>
+    static auto package (R &&function, A &&...args);
+
+    // internal methods that add task(s) to the pool
+    void enqueue (Priority priority, Task &&task);
+    void enqueue (Priority priority, std::vector<Job> &&jobs);
+
+    // add a task unless the queue is full, returns whether it was added
+    bool try_enqueue (Priority priority, Task &&task);
+
+    // whether tasks submitted by the calling thread would overflow
+    bool full () const;
+
+    // deal with a full queue according to the policy, returns false if the
+    // caller must run the tasks itself
+    bool make_room ();
+
+    // run tasks that didn't get in the queue on the calling thread
+    void run_here (size_t level, Job *jobs, size_t n);
+
+    // push jobs to a worker queue and wake up sleeping threads if any
+    void push (size_t level, Job *jobs, size_t n);
+
+    // drop a job that won't run: its task is only called with 'discarding'
+    // set, so that it fails its future with Cancelled (tasks of the pool
+    // and those queued by Graph and schedule() check it)
+    void discard (Job &job);
+
+    // look for new tasks a little before sleeping, true if there are some
+    bool linger ();
+
+    // choose the worker receiving tasks submitted from outside the pool
+    size_t pick ();
+
+    // start one more worker thread, unless there are enough
+    void spawn  ();
+
+    // stop worker 'self' if it's the last one and the pool may shrink
+    bool retire (size_t self);
+
+    // pop a job from worker 'self' or steal it from another worker, also
+    // returning the priority level it was queued at
+    bool pop  (size_t self, Job &job, size_t &level);
+
+    // take a job of given level from a worker (which must be locked), the
+    // newest of its own if taken by the owner
+    bool take (Worker &worker, size_t level, bool owner, Job &job);
+
+    // lock the mutex, counting it as contended if it was already locked
+    static std::unique_lock<std::mutex> acquire (std::mutex &mutex,
+                                                 std::atomic<uint64_t> &count);
+
+    // whether times are being measured, see enable_stats()
+    inline bool timing () const {
+      return timed_stats && measuring.load(std::memory_order_relaxed);
+    }
+
+    // Observer
+    //
+    // Hooks set by observe(), bound to the type of their object.
+    struct Observer {
+      void  *object{nullptr};                      // the observer itself
+      void (*enqueued)(void *, size_t){nullptr};   // object->enqueued(n)
+      void (*dequeued)(void *, size_t){nullptr};   // object->dequeued(n)
+    };
+
+    // queue task at a given time (drop it if the pool is closed)
+    void arm    (std::chrono::steady_clock::time_point when, Task &&task);
+
+    // run work() at 'due' and then every period until the token is cancelled
+    template<typename W>
+    void repeat (std::chrono::steady_clock::time_point due,
+                 std::chrono::steady_clock::duration period,
+                 CancelToken const &token, std::shared_ptr<W> const &work);
+
+    // queue the timers that are due, unless someone else is doing it
+    void expire ();
+
+    // keep time for the pool: sleep until the next timer is due (or some
+    // task comes) and queue what is due by then
+    void keep   ();
+
+    // drop every timer waiting, as if they were discarded
+    void disarm ();
+
+    // replace the observer, once no thread is calling the previous one
+    void attach (Observer const &hooks);
+
+    // call one hook of the observer with n tasks, unless it's removed
+    void hook   (void (*Observer::*which)(void *, size_t), size_t n);
+
+    // execute the enqueue/dequeue hooks accounting for n tasks, without an
+    // observer it costs a single flag
+    inline void enqueue_hook (size_t n) {
+      if (hooked.load(std::memory_order_relaxed))
+        hook(&Observer::enqueued, n);
+    }
+    inline void dequeue_hook (size_t n) {
+      if (hooked.load(std::memory_order_relaxed))
+        hook(&Observer::dequeued, n);
+    }
+
+    // run a job taken from a queue (counters of the worker running it, null
+    // for anyone else) with all the accounting around it
+    void perform (Job &job, size_t level, Counters *counters);
+
+    // main loop executed by worker 'self'
+    void run  (size_t self);
+
+    // whether the current thread is dropping tasks instead of running them
+    static inline thread_local bool discarding = false;
+
+    std::atomic<bool>         done;             // whether finished tasks
+    std::atomic<bool>         closed;           // whether refusing tasks
+    std::atomic<size_t>       pending;          // count tasks in queues
+    std::atomic<size_t>       capacity;         // most tasks (0 unbounded)
+    std::atomic<Overflow>     overflow;         // policy when full
+    std::atomic<size_t>       blocked;          // count threads on pending
+    std::array<std::atomic<size_t>, levels> waiting; // tasks in each level
+    std::atomic<size_t>       processing;       // count working threads
+    std::atomic<size_t>       sleeping;         // count threads on queued
+    std::atomic<size_t>       next;             // round robin for outsiders
+    std::atomic<bool>         hooked;           // whether observed
+    std::atomic<size_t>       hooking;          // outsiders in the hooks
+    std::atomic<bool>         measuring;        // whether measuring times
+    std::atomic<uint64_t>     contended;        // contention of queue_lock
+    Elastic                   bounds;           // limits of the size
+    bool                      elastic;          // whether size may change
+    std::atomic<size_t>       live;             // count running threads
+    std::atomic<int64_t>      dequeued_at;      // last (rough) dequeue time
+    std::mutex                grow_lock;        // guard spawn and retire
+    std::atomic<size_t>       nested;           // count waiting workers
+    std::atomic<size_t>       waiters;          // count threads in wait()
+    Counters                  outsiders;        // tasks run by outsiders
+    std::atomic<size_t>       parked;           // count threads on wakeups
+    std::atomic<uint32_t>     wakeups;          // changes to wake them up
+    struct {
+      std::atomic<size_t>     spins, yields;
+    }                         idling;           // idle policy in use
     std::condition_variable   queued, dequeued; // signals when add/rm task
-    std::mutex                queue_lock;       // guard sensitive access
+    std::mutex                queue_lock;       // guard sleep and wake ups
+    std::mutex                hook_lock;        // guard observe()
+    std::vector<std::unique_ptr<Worker>> workers; // local queue per thread
+    std::vector<std::vector<size_t>> groups; // workers of each NUMA node
+    std::vector<int>          group_of;         // group of a cpu (or -1)
     std::vector<std::thread>  threads;          // list of running threads
-    std::queue<Task<>>        tasks;            // queue of tasks to be run
-    std::function<void()>     hook_enqueue;     // executes after enqueueing
-    std::function<void()>     hook_dequeue;     // executes after finish task
+    Observer                  observer;         // hooks set by observe()
+    TimerWheel                timers;           // tasks waiting for a time
+    std::mutex                timer_lock;       // guard the timers
+    std::atomic<int64_t>      next_timer;       // clock ticks of next due
+    std::atomic<bool>         keeping;          // whether a worker keeps time
   };
 
-  template<typename R, typename ...A, typename>
-  auto Pool::execute(R &&function, A &&...args) {
+  template<typename H>
+  void Pool::observe(H *hooks) {
+    // the calls are bound here to plain functions, once per type
+    if (std::is_same_v<H, NoHooks> || !hooks)
+      return attach({});
+    attach({
+      hooks,
+      [](void *hooks, size_t n) {static_cast<H*>(hooks)->enqueued(n);},
+      [](void *hooks, size_t n) {static_cast<H*>(hooks)->dequeued(n);},
+    });
+  }
+
+  template<typename R, typename ...A>
+  auto Pool::package(R &&function, A &&...args) {
     using namespace std;
     // The lambda is used to construct the task by coupling the function with
     // its arguments.  We need to be careful about how we pass on the
@@ -92,51 +776,258 @@ namespace ThreadPool {
     // inadvertently miss the reference when they are accessed later.
     // forward() takes care of keeping the value category
     // move() guarantees we now have ownership of the data we will use later
-    // Now we pass this task to the enqueue() method that returns a future.
-    return enqueue(Task<invoke_result_t<R, A...>>{[
-      function = move(function),
-      args     = make_tuple(forward(args)...)
+    // The packaged task holds the shared state of the future (its only
+    // allocation) and is small enough to be stored inline in a Task.
+    packaged_task<invoke_result_t<R, A...>()> task{[
+      function = forward<R>(function),
+      args     = make_tuple(forward<A>(args)...)
     ] () mutable {
+      if (discarding)
+        throw Cancelled{};
       return apply(move(function), move(args));
-    }});
+    }};
+    return task;
   }
 
-  template <typename R, typename ...A, typename>
-  auto Pool::split(R &&function, long n, A &&...args) {
+  template<typename R, typename ...A, typename>
+  auto Pool::execute(Priority priority, R &&function, A &&...args) {
+    auto task   = package(std::forward<R>(function), std::forward<A>(args)...);
+    auto future = task.get_future();
+    enqueue(priority, std::move(task));
+    return future;
+  }
+
+  template<typename R, typename ...A, typename>
+  auto Pool::try_execute(Priority priority, R &&function, A &&...args) {
+    auto task   = package(std::forward<R>(function), std::forward<A>(args)...);
+    auto future = std::optional{task.get_future()};
+    if (!try_enqueue(priority, std::move(task)))
+      future.reset();
+    return future;
+  }
+
+  template<typename R, typename ...A, typename>
+  void Pool::post(Priority priority, R &&function, A &&...args) {
     using namespace std;
-    // we want to split a work in equal parts among the threads so we need as
-    // many future values as the number of threads.
-    using result_t = invoke_result_t<R, long, A...>;
-    vector<future<result_t>> futures{threads.size()};
+    // same as execute(), but the lambda is the task itself: without a
+    // future there is no shared state and, when the captured function and
+    // arguments fit in the inline storage of a Task, no allocation at all
+    enqueue(priority, [
+      function = forward<R>(function),
+      args     = make_tuple(forward<A>(args)...)
+    ] () mutable {
+      if (discarding)
+        return;
+      try {
+        apply(move(function), move(args));
+      }
+      catch (...) {
+        // nobody is listening, an exception must not kill the worker
+      }
+    });
+  }
+
+  template<typename R, typename ...A, typename>
+  auto Pool::execute(Priority priority, CancelToken const &token,
+                     R &&function, A &&...args) {
+    using namespace std;
+    // the token is checked right before calling the function, so a task
+    // cancelled while in queue costs no more than its dequeue
+    return execute(priority, [
+      token,
+      function = forward<R>(function),
+      args     = make_tuple(forward<A>(args)...)
+    ] () mutable {
+      if (token.cancelled())
+        throw Cancelled{};
+      return apply(move(function), move(args));
+    });
+  }
 
-    // now for each part we create a task with execute using our splitted n
-    for (auto &future : futures)
-      future = execute(move(function), n/threads.size(), forward(args)...);
+  template<typename R, typename ...A, typename>
+  void Pool::post(Priority priority, CancelToken const &token, R &&function,
+                  A &&...args) {
+    using namespace std;
+    post(priority, [
+      token,
+      function = forward<R>(function),
+      args     = make_tuple(forward<A>(args)...)
+    ] () mutable {
+      if (!token.cancelled())
+        apply(move(function), move(args));
+    });
+  }
+
+  template<typename R, typename ...A, typename>
+  auto Pool::execute_after(std::chrono::steady_clock::duration delay,
+                           R &&function, A &&...args) {
+    auto task   = package(std::forward<R>(function), std::forward<A>(args)...);
+    auto future = task.get_future();
+    arm(std::chrono::steady_clock::now() + delay, std::move(task));
+    return future;
+  }
+
+  template<typename R, typename ...A, typename>
+  CancelToken Pool::execute_every(std::chrono::steady_clock::duration period,
+                                  R &&function, A &&...args) {
+    using namespace std;
+    // function and arguments are shared by all runs, which may not move them
+    auto work = [
+      function = forward<R>(function),
+      args     = make_tuple(forward<A>(args)...)
+    ] () mutable {
+      apply(function, args);
+    };
+    CancelToken token;
+    period = max(period, chrono::steady_clock::duration{1});
+    repeat(chrono::steady_clock::now() + period, period, token,
+           make_shared<decltype(work)>(std::move(work)));
+    return token;
+  }
 
+  template<typename W>
+  void Pool::repeat(std::chrono::steady_clock::time_point due,
+                    std::chrono::steady_clock::duration period,
+                    CancelToken const &token, std::shared_ptr<W> const &work) {
+    // every run arms the next one once it's done, a period after it was due
+    // (or the first of those periods still ahead)
+    arm(due, [this, due, period, token, work]() {
+      if (discarding || token.cancelled())
+        return;
+      try {
+        (*work)();
+      }
+      catch (...) {
+        // nobody is listening, an exception must not stop the runs
+      }
+      auto next = due + period;
+      auto now  = std::chrono::steady_clock::now();
+      if (next <= now)
+        next += ((now - next) / period + 1) * period;
+      if (!token.cancelled())
+        repeat(next, period, token, work);
+    });
+  }
+
+  template<typename I, typename R, typename>
+  auto Pool::execute_batch(Priority priority, I first, I last,
+                           R &&function) {
+    using namespace std;
+    using result_t = invoke_result_t<R, iter_reference_t<I>>;
+    vector<future<result_t>> futures;
+    vector<Job>              jobs;
+    if constexpr (sized_sentinel_for<I, I>) {
+      futures.reserve(last - first);
+      jobs.reserve(last - first);
+    }
+
+    // every task gets its own iterator and a copy of the function
+    for (; first != last; ++first) {
+      packaged_task<result_t()> task{[function, first] () mutable {
+        if (discarding)
+          throw Cancelled{};
+        return invoke(function, *first);
+      }};
+      futures.push_back(task.get_future());
+      jobs.push_back({move(task), 1});
+    }
+
+    enqueue(priority, move(jobs));
     return futures;
   }
 
-  template<typename T>
-  auto Pool::enqueue(T &&task) {
+  template<typename I, typename R, typename>
+  void Pool::post_batch(Priority priority, I first, I last, R &&function) {
     using namespace std;
-    // get the future result of the task
-    auto future = task.get_future();
+    vector<Job> jobs;
+    if constexpr (sized_sentinel_for<I, I>)
+      jobs.reserve(last - first);
+
+    // every task gets its own iterator and a copy of the function
+    for (; first != last; ++first)
+      jobs.push_back({[function, first] () mutable {
+        if (discarding)
+          return;
+        try {
+          invoke(function, *first);
+        }
+        catch (...) {
+          // nobody is listening, an exception must not kill the worker
+        }
+      }, 1});
+
+    enqueue(priority, move(jobs));
+  }
 
-    {
-      // careful to lock the queue while we emplace a new task
-      unique_lock _(queue_lock);
-      tasks.emplace(move(task));
+  template<typename F, typename>
+  void Pool::wait(F const &future) {
+    using namespace std::chrono;
+    // the future needs no lock, this one only satisfies wait_until()
+    std::mutex unused;
+    std::unique_lock lock{unused};
+    wait_until(lock,
+      [&future]() -> bool {
+        return future.wait_for(0s) == std::future_status::ready;
+      },
+      [&future](microseconds pause) {future.wait_for(pause);});
+  }
+
+  template<typename P, typename S>
+  void Pool::wait_until(std::unique_lock<std::mutex> &lock, P const &done,
+                        S const &sleep) {
+    using namespace std::chrono;
+    // nothing to run: check again a bit later, each time later
+    for (microseconds pause{1}; !done();) {
+      lock.unlock();
+      bool helped = help();
+      lock.lock();
+      if (helped)
+        pause = microseconds{1};
+      else {
+        sleep(pause);
+        pause = std::min<microseconds>(2*pause, 1ms);
+      }
     }
+  }
 
-    // execute the enqueue hook if there is one
-    if (hook_enqueue)
-      hook_enqueue();
+  template<typename R, typename>
+  void Pool::parallel_for(long begin, long end, R &&function,
+                          Schedule schedule, long chunk) {
+    // the function is only referenced: we don't return before it's done
+    for_each_chunk({begin, end, schedule, chunk, size()}, std::ref(function));
+  }
 
-    // notify the next available thread that a task was added
-    queued.notify_one();
+  template<typename T, typename M, typename R, typename, typename>
+  T Pool::parallel_reduce(long begin, long end, T init, M &&map, R &&reduce,
+                          Schedule schedule, long chunk) {
+    using namespace std;
+    // chunks are mapped in parallel and only the combination is serialized
+    mutex lock;
+    parallel_for(begin, end, [&](long b, long e) {
+      T value = invoke(map, b, e);
+      unique_lock _{lock};
+      init = invoke(reduce, move(init), move(value));
+    }, schedule, chunk);
+    return init;
+  }
 
-    // return the future associated with this task
-    return future;
+  template <typename R, typename ...A, typename>
+  auto Pool::split(R &&function, long n, A &&...args) {
+    using namespace std;
+    // we want to split a work in equal parts among the threads so we need as
+    // many future values as the number of threads.
+    using result_t = invoke_result_t<R, long, A...>;
+    vector<future<result_t>> futures{size()};
+
+    // now for each part we create a task with execute using our splitted n,
+    // the remainder is given one by one to the first parts so that the
+    // whole n is covered, and each part gets its own copy of the function
+    for (size_t i{0}; i < size(); ++i) {
+      long part = n/long(size()) + (long(i) < n%long(size()));
+      futures[i] = execute(decay_t<R>{function}, part, decay_t<A>{args}...);
+    }
+
+    return futures;
   }
 
 }
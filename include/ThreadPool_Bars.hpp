@@ -1,25 +1,72 @@
 #ifndef THREADPOOL_BARS_HPP
 #define THREADPOOL_BARS_HPP
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 #include "Progress.hpp"
 #include "ThreadPool.hpp"
+#include "ThreadPool_Group.hpp"
+#include "ThreadPool_Pipeline.hpp"
+#include "ThreadPool_Sink.hpp"
 
 namespace ThreadPool {
 
+  // Refresh
+  //
+  // Settings of how Bars updates its output.  The tracker only redraws when
+  // some bar has changed by at least 'delta', never faster than 'rate', and
+  // sleeps longer and longer while nothing happens.  When the output is not
+  // a terminal (mode Auto), escape sequences are useless: only the total
+  // progress is printed as plain text lines, at a much lower rate.  With a
+  // Sink (mode Report) nothing is printed, the sink gets a snapshot of the
+  // progress at a steady rate instead.  With more workers than 'compact'
+  // (or than rows on the terminal) the workers are summed up: a histogram
+  // of their progress, how many are stalled and a bar for the few slowest
+  // ones, so a frame costs the same with any number of threads.
+  struct Refresh {
+    enum Mode {
+      Auto,      // Terminal if standard output is a terminal, else Plain
+      Terminal,  // draw all bars in place using escape sequences
+      Plain,     // print a line of text with the total progress
+      Report,    // hand snapshots to a sink (set when given one)
+      Off,       // don't print anything (and don't even track progress)
+    };
+
+    Mode   mode   = Auto;      // what kind of output
+    double rate   = 60;        // maximum redraws per second on a terminal
+    double delta  = 1.0/320;   // minimum visible change of a bar to redraw
+    double plain  = 0.2;       // maximum lines per second in Plain mode
+    double report = 1;         // snapshots per second in Report mode
+    size_t compact = 32;       // bars of workers shown at most, else summed
+    size_t slowest = 4;        // bars of the slowest workers when summed
+    double stalled = 10;       // seconds without progress to be stalled
+  };
+
   // Bars
   //
   // This class implements a list of progress bars to track the progress of
   // ThreadPool::Pool.  Each progress bar corresponds to one worker thread,
   // and an additional bar (the first) corresponds to the total progress of
-  // all workers combined.
+  // all workers combined.  Every worker has its own slot, so counting never
+  // takes a lock and the tracker thread reads the counters as they go.  In
+  // an elastic pool, bars come and go with the worker threads.
   class Bars {
    public:
     // constructor gets a reference to the pool that we are going to track
-    Bars(Pool &pool);
+    Bars(Pool &pool, Refresh refresh={});
 
-    // destructor will clean up the hooks and finish the tracker thread
+    // same as above, but the progress goes to a sink instead of the output
+    Bars(Pool &pool, std::shared_ptr<Sink> sink, Refresh refresh={});
+
+    // destructor stops observing the pool and finishes the tracker thread
     ~Bars();
 
     // new_counter(n, message) -> counter
@@ -27,34 +74,140 @@ namespace ThreadPool {
     // Create a new counter (and associated bar) for current thread.
     //   n        :total number of steps to count towards
     //   message  :message to show beside this thread's bar
+    // Threads that are not workers of the pool share one extra bar, but
+    // every thread gets its own counter, and so does every task it runs
+    // inside another one while waiting (e.g. in pool.wait()).
     Progress::Counter& new_counter (int n, std::string_view message="");
 
     // set the message to be displayed beside the total progress bar
     void               set_message (std::string_view message);
 
+    // show a bar with the progress of a task group (and of the groups
+    // nested in it) below the total bar, until the group is destroyed
+    void               track       (TaskGroup const &group);
+
+    // show a bar per stage of a pipeline instead of a bar per thread (the
+    // threads run all stages alike), until the pipeline is destroyed
+    void               track       (Pipeline const &pipeline);
+
     // wait until tracker thread has been joined, output and bars are ready
     void               wait        ();
 
    private:
-    // a couple of internal naming shortcuts
-    using Thread_ID  = std::thread::id;
-    using Thread_Bar = std::pair<Progress::Counter, std::string>;
-    using List       = std::map<Thread_ID, Thread_Bar>;
+    // the pool calls enqueued() and dequeued(), see Pool::observe()
+    friend class Pool;
+
+    using clock = std::chrono::steady_clock;
+
+    // number of buckets of the histogram of workers in compact view
+    static constexpr size_t buckets = 10;
+
+    // Meter
+    //
+    // Counter of a task and its message.  A thread has one for each depth
+    // of tasks it runs inside others while waiting, so a nested task never
+    // resets the counter of the task it interrupted.
+    struct Meter {
+      Progress::Counter counter;   // progress of the task
+      std::string       message;   // message shown beside its bar
+    };
+
+    // Slot
+    //
+    // Bar of one worker thread.  Only the owner thread writes the counter
+    // (relaxed atomics) and slots live in their own cache line, so workers
+    // never invalidate each other's counters.  The message is written once
+    // per counter under its lock, which the tracker only ever tries to get.
+    // The bar shows the latest counter created by a task of the thread, and
+    // goes back to the one of the outer task when a nested one finishes.
+    struct alignas(64) Slot {
+      using Key = std::pair<std::thread::id, size_t>;
+
+      Progress::Counter counter;   // progress of the total (or of nothing)
+      std::atomic<Progress::Counter*> current; // counter shown in the bar
+      std::atomic<size_t> depth;   // depth of the task owning that counter
+      std::map<Key, Meter> meters; // per thread and depth (under the lock)
+      std::atomic<bool> used;      // whether the bar should be shown
+      std::atomic<size_t> generation; // of the worker that used it
+      std::mutex        lock;      // guard the message
+      std::string       message;   // message shown beside the bar
+      std::string       shown;     // copy of message owned by the tracker
+      std::atomic<size_t> started; // counters created (to spot a new one)
+      long              seen;      // count when last seen moving (tracker)
+      size_t            known;     // counters created by then (tracker)
+      clock::time_point since;     // when it was last seen moving (tracker)
+
+      Slot() : current{&counter}, depth{0}, used{false}, generation{0}
+             , started{0}, seen{0}, known{0} {}
+    };
+
+    // account for n new tasks, starting the tracker for the first ones
+    void        enqueued (size_t n);
+
+    // account for n finished tasks, waking up the tracker if needed
+    void        dequeued (size_t n);
+
+    // return the slot associated with the calling thread
+    Slot&       get_slot ();
+
+    // show again the counter of the task of given depth (or of an outer
+    // one) of the calling thread, once those inside it are finished
+    void        resume   (Slot &slot, size_t depth);
+
+    // whether slot i has a bar to be shown
+    bool        visible  (size_t i) const;
+
+    // print all bars to the stdout if they changed (or if forced to)
+    bool        print    (bool force=false);
+
+    // print the total progress as a line of text if it changed enough
+    bool        print_plain (bool force=false);
+
+    // hand a snapshot of the progress to the sink
+    bool        report   (bool finished=false);
+
+    // fractions of the total bar (with partial progress of running tasks)
+    // and of every visible bar, whose slots are appended to 'shown'
+    std::vector<double> measure (std::vector<size_t> &shown) const;
+
+    // sum up the workers of 'shown' (with their 'fractions' after the
+    // total) as a histogram, leaving only the slowest ones in both, and
+    // return the histogram, the number of workers and of stalled ones, then
+    // index and seconds stalled of every slowest one
+    std::vector<double> summarize (std::vector<double> &fractions,
+                                   std::vector<size_t> &shown);
 
-    // return the bar (counter + message) associated with given thread id
-    Thread_Bar& get_bar (Thread_ID id);
+    // number of rows of the terminal (unlimited if unknown)
+    size_t      rows     () const;
 
-    // print all bars to the stdout
-    void        print   ();
+    // progress still alive in a list of tracked ones, forgetting the others
+    std::vector<std::shared_ptr<Tally>> tallies (
+      std::vector<std::weak_ptr<Tally>> &tracked);
 
     // spawn a new thread responsible for tracking the progress of the pool
-    void        start   ();
+    void        start    ();
 
     Pool        &pool;     // pool that we are tracking
-    List        bars;      // list of bars currently in use
-    std::mutex  mutex;     // guard the bars list when add/rm bars
+    Refresh     refresh;   // how to update the output
+    std::shared_ptr<Sink> sink;  // where reports go in Report mode
+    clock::time_point began;     // when the round of tasks started
+    clock::time_point reported;  // when the last report was made
+    double      reached;   // tasks (with partial ones) done at last report
+    double      rate;      // smoothed tasks per second
+    std::vector<double> drawn;  // fractions of the bars last drawn
+    Slot        total;     // total bar, counting tasks of the pool
+    size_t      nslots;    // number of slots: one per worker + others
+    Progress::Screen screen;  // terminal where bars are drawn
+    std::unique_ptr<Slot[]> slots;  // bars of each thread
+    std::mutex  mutex;     // guard the start and end of tracking
+    std::mutex  restart;   // guard joining and restarting the tracker
+    std::mutex  grouping;  // guard the lists of groups and stages
+    std::vector<std::weak_ptr<Tally>> groups;  // groups tracked
+    std::vector<std::weak_ptr<Tally>> stages;  // pipeline stages tracked
+    std::condition_variable changed;  // signals that tasks were done
+    std::atomic<bool> updated; // whether tasks were done since refresh
     std::thread tracker;   // thread running the tracking
-    bool        tracking;  // whether we are still tracking the pool
+    std::atomic<bool> tracking;  // whether we are still tracking the pool
   };
 
 }
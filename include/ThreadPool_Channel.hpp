@@ -0,0 +1,255 @@
+#ifndef THREADPOOL_CHANNEL_HPP
+#define THREADPOOL_CHANNEL_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <variant>
+#include <vector>
+#include "Cancel.hpp"
+#include "TaskQueue.hpp"
+#include "ThreadPool.hpp"
+
+namespace ThreadPool {
+
+  // Channel
+  //
+  // Results of tasks delivered to a single consumer as soon as they exist,
+  // instead of one future per task, e.g.
+  //   Channel<Image> images{pool};
+  //   images.post_batch(files, [](auto &file) {return load(file);});
+  //   while (auto image = images.receive())
+  //     show(*image);
+  // Results come in order of completion, or in order of submission when
+  // asked for (the ones that finish early wait in a reorder buffer).  Tasks
+  // may be posted by any thread, results are received by one at a time.
+  // Results live in a buffer that is reused, there is no shared state per
+  // task.
+  template<typename T>
+  class Channel {
+   private:
+    template<typename ...U>
+    using IsInvocable = std::enable_if_t<std::is_invocable_v<U&&...>>;
+
+   public:
+    // order in which results are received
+    enum Order {
+      Completion,  // as soon as each task finishes
+      Submission,  // in the order the tasks were posted
+    };
+
+    // constructor gets the pool running the tasks and the order of results
+    Channel(Pool &pool, Order order=Completion)
+        : pool{pool}, order{order}, head{0}, posted{0}, delivered{0}
+        , received{0} {}
+
+    // destructor waits for the tasks still running (results are dropped)
+    ~Channel() {
+      std::unique_lock lock{this->lock};
+      block(lock, [this]() -> bool {return delivered == posted;});
+    }
+
+    Channel(Channel const &)            = delete;
+    Channel& operator= (Channel const &) = delete;
+
+    // post (function(), ...args)
+    //
+    // Create a new task executing function(args), whose result is sent to
+    // the channel (an exception thrown is sent as well)
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    void post(R &&function, A &&...args) {
+      post(Priority::Normal, std::forward<R>(function),
+           std::forward<A>(args)...);
+    }
+
+    // same as above at the given priority level
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    void post(Priority priority, R &&function, A &&...args);
+
+    // post_batch (first, last, function())
+    //
+    // Create one task per element in [first, last) executing function(*it)
+    // all at once, see Pool::post_batch().  In order of submission, results
+    // come in the order of the elements.
+    template<typename I, typename R, typename=IsInvocable<R,
+      std::iter_reference_t<I>>>
+    void post_batch(I first, I last, R &&function) {
+      post_batch(Priority::Normal, first, last, std::forward<R>(function));
+    }
+
+    // same as above at the given priority level
+    template<typename I, typename R, typename=IsInvocable<R,
+      std::iter_reference_t<I>>>
+    void post_batch(Priority priority, I first, I last, R &&function);
+
+    // same as above for a whole range, e.g. post_batch(vector, function)
+    template<std::ranges::range V, typename R, typename=IsInvocable<R,
+      std::ranges::range_reference_t<V>>>
+    void post_batch(V &&range, R &&function) {
+      post_batch(Priority::Normal, std::ranges::begin(range),
+                 std::ranges::end(range), std::forward<R>(function));
+    }
+
+    // receive () -> result, if any
+    //
+    // Wait for the next result and return it, or rethrow the exception of
+    // its task (Cancelled if the pool dropped it).  Returns an empty
+    // optional once every task posted so far has been received.  It runs
+    // tasks of the pool meanwhile, so it may be called from inside a task.
+    std::optional<T> receive ();
+
+    // number of results posted but not received yet
+    inline size_t pending () const {
+      std::unique_lock _{lock};
+      return posted - received;
+    }
+
+   private:
+    // outcome of a task: its result or its exception
+    using Result = std::variant<T, std::exception_ptr>;
+
+    // run a task and deliver its result to slot 'index' of its order
+    template<typename F>
+    void run     (size_t index, F &function);
+
+    // store the result of task number 'index' (in order of submission)
+    void deliver (size_t index, Result &&result);
+
+    // wait (with the lock) until done(), see receive()
+    template<typename P>
+    void block   (std::unique_lock<std::mutex> &lock, P const &done);
+
+    Pool                    &pool;       // pool executing the tasks
+    Order                    order;      // order of the results
+    std::deque<std::optional<Result>> slots; // results not received yet
+    size_t                   head;       // index of the first slot
+    size_t                   posted;     // count tasks posted
+    size_t                   delivered;  // count results delivered
+    size_t                   received;   // count results received
+    mutable std::mutex       lock;       // guard all of the above
+    std::condition_variable  ready;      // signals a result was delivered
+  };
+
+  template<typename T>
+  template<typename R, typename ...A, typename>
+  void Channel<T>::post(Priority priority, R &&function, A &&...args) {
+    using namespace std;
+    size_t index;
+    {
+      unique_lock _{lock};
+      index = posted++;
+    }
+    // queued as a bare task: when the pool drops it, the result is still
+    // delivered (as Cancelled), otherwise the receiver would wait forever,
+    // and so is the reason why a full pool refused it
+    try {
+      pool.enqueue(priority, [
+        this, index,
+        function = forward<R>(function),
+        args     = make_tuple(forward<A>(args)...)
+      ] () mutable {
+        auto call = [&]() -> T {return apply(move(function), move(args));};
+        run(index, call);
+      });
+    }
+    catch (...) {
+      deliver(index, current_exception());
+      throw;
+    }
+  }
+
+  template<typename T>
+  template<typename I, typename R, typename>
+  void Channel<T>::post_batch(Priority priority, I first, I last,
+                              R &&function) {
+    using namespace std;
+    vector<Job> jobs;
+    if constexpr (sized_sentinel_for<I, I>)
+      jobs.reserve(last - first);
+
+    // the whole batch gets consecutive indices at once
+    unique_lock lock{this->lock};
+    size_t start = posted;
+    for (; first != last; ++first)
+      jobs.push_back({[this, index = posted++, function, first] () mutable {
+        auto call = [&]() -> T {return invoke(function, *first);};
+        run(index, call);
+      }, 1});
+    size_t end = posted;
+    lock.unlock();
+
+    try {
+      pool.enqueue(priority, move(jobs));
+    }
+    catch (...) {
+      for (size_t index = start; index < end; ++index)
+        deliver(index, current_exception());
+      throw;
+    }
+  }
+
+  template<typename T>
+  std::optional<T> Channel<T>::receive() {
+    std::unique_lock lock{this->lock};
+    if (received == posted)
+      return std::nullopt;
+
+    // the next result is the first slot, once it's filled
+    block(lock, [this]() -> bool {return !slots.empty() && slots.front();});
+    Result result = std::move(*slots.front());
+    slots.pop_front();
+    ++head;
+    ++received;
+    lock.unlock();
+
+    if (result.index())
+      std::rethrow_exception(std::get<1>(result));
+    return std::move(std::get<0>(result));
+  }
+
+  template<typename T>
+  template<typename F>
+  void Channel<T>::run(size_t index, F &function) {
+    if (Pool::discarding)
+      return deliver(index, std::make_exception_ptr(Cancelled{}));
+    try {
+      deliver(index, Result{std::in_place_index<0>, function()});
+    }
+    catch (...) {
+      deliver(index, std::current_exception());
+    }
+  }
+
+  template<typename T>
+  void Channel<T>::deliver(size_t index, Result &&result) {
+    // the channel may be gone as soon as the last result is seen, so it's
+    // signalled under the lock and nothing is touched after that
+    std::unique_lock _{lock};
+    if (order == Completion)
+      slots.emplace_back(std::move(result));
+    else {
+      size_t slot = index - head;
+      if (slot >= slots.size())
+        slots.resize(slot + 1);
+      slots[slot].emplace(std::move(result));
+    }
+    ++delivered;
+    ready.notify_all();
+  }
+
+  template<typename T>
+  template<typename P>
+  void Channel<T>::block(std::unique_lock<std::mutex> &lock, P const &done) {
+    // run tasks of the pool meanwhile, as any waiting thread does
+    pool.wait_until(lock, done, [&](std::chrono::microseconds pause) {
+      ready.wait_for(lock, pause, done);
+    });
+  }
+
+}
+
+#endif
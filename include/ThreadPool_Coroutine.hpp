@@ -0,0 +1,174 @@
+#ifndef THREADPOOL_COROUTINE_HPP
+#define THREADPOOL_COROUTINE_HPP
+
+#include <coroutine>
+#include <exception>
+#include <future>
+#include <optional>
+#include <utility>
+#include "ThreadPool.hpp"
+
+namespace ThreadPool {
+
+  // CoroutineResult
+  //
+  // Storage of the value returned by a Coroutine<T> (nothing if void).
+  template<typename T>
+  struct CoroutineResult {
+    std::optional<T> value;
+
+    void return_value (T result) {value.emplace(std::move(result));}
+    T    result       ()         {return std::move(*value);}
+  };
+
+  template<>
+  struct CoroutineResult<void> {
+    void return_void () {}
+    void result      () {}
+  };
+
+  // Coroutine
+  //
+  // Lazy coroutine returning a T, e.g.
+  //   Coroutine<int> answer(Pool &pool) {
+  //     co_await pool.schedule();        // from now on it runs on the pool
+  //     int half = co_await compute();   // another Coroutine<int>
+  //     co_return 2*half;
+  //   }
+  // It only starts when awaited, and awaiting it suspends the caller (the
+  // thread goes on with other tasks) until it finishes, when the caller is
+  // resumed right away on the same thread.  Exceptions propagate to the
+  // caller.  Start one from regular code with spawn().
+  template<typename T=void>
+  class Coroutine {
+   public:
+    struct promise_type;
+    using  handle = std::coroutine_handle<promise_type>;
+
+    struct promise_type : CoroutineResult<T> {
+      std::coroutine_handle<> continuation;  // coroutine awaiting this one
+      std::exception_ptr      error;         // exception thrown, if any
+
+      Coroutine get_return_object () {
+        return Coroutine{handle::from_promise(*this)};
+      }
+
+      // lazy: nothing runs until it is awaited
+      std::suspend_always initial_suspend () noexcept {return {};}
+
+      // when done, transfer control to whoever is awaiting (if anyone)
+      auto final_suspend () noexcept {
+        struct Final {
+          bool await_ready  () const noexcept {return false;}
+          void await_resume () const noexcept {}
+          std::coroutine_handle<> await_suspend (handle self) noexcept {
+            if (auto next = self.promise().continuation)
+              return next;
+            return std::noop_coroutine();
+          }
+        };
+        return Final{};
+      }
+
+      void unhandled_exception () {error = std::current_exception();}
+    };
+
+    // coroutines can be moved around, but never copied
+    Coroutine (Coroutine &&other) noexcept
+        : coroutine{std::exchange(other.coroutine, {})} {}
+
+    Coroutine& operator= (Coroutine &&other) noexcept {
+      if (this != &other) {
+        if (coroutine)
+          coroutine.destroy();
+        coroutine = std::exchange(other.coroutine, {});
+      }
+      return *this;
+    }
+
+    ~Coroutine () {
+      if (coroutine)
+        coroutine.destroy();
+    }
+
+    // co_await coroutine -> T
+    //
+    // Start the coroutine, suspending the caller until it is finished.
+    auto operator co_await () && noexcept {
+      struct Awaiter {
+        handle coroutine;
+
+        bool await_ready () const noexcept {return false;}
+
+        // symmetric transfer: the coroutine starts on this very thread
+        std::coroutine_handle<> await_suspend (std::coroutine_handle<> next) {
+          coroutine.promise().continuation = next;
+          return coroutine;
+        }
+
+        T await_resume () {
+          if (coroutine.promise().error)
+            std::rethrow_exception(coroutine.promise().error);
+          return coroutine.promise().result();
+        }
+      };
+      return Awaiter{coroutine};
+    }
+
+   private:
+    explicit Coroutine (handle coroutine) : coroutine{coroutine} {}
+
+    handle coroutine;  // frame of the coroutine (owned)
+  };
+
+  // Detached
+  //
+  // Eager coroutine that nobody awaits, it destroys itself once finished.
+  struct Detached {
+    struct promise_type {
+      Detached            get_return_object   () noexcept {return {};}
+      std::suspend_never  initial_suspend     () noexcept {return {};}
+      std::suspend_never  final_suspend       () noexcept {return {};}
+      void                return_void         () noexcept {}
+      void                unhandled_exception () noexcept {std::terminate();}
+    };
+  };
+
+  // spawn (pool, coroutine, priority) -> future
+  //
+  // Start a coroutine as a task of the pool and return a future of its
+  // result, the bridge between regular code and coroutines.
+  //   pool       :pool where the coroutine starts running
+  //   coroutine  :coroutine to be started
+  //   priority   :priority level of the first task
+  // Every time the coroutine goes through the pool, i.e. when started and
+  // after each 'co_await pool.schedule()', it counts as one more task for
+  // the enqueue/dequeue hooks and for the bars.  If the pool drops it, the
+  // future gets Cancelled.
+  template<typename T>
+  std::future<T> spawn (Pool &pool, Coroutine<T> coroutine,
+                        Priority priority=Priority::Normal) {
+    // the promise lives in the frame of a detached coroutine that waits
+    std::promise<T> promise;
+    auto future = promise.get_future();
+    [](Pool &pool, Priority priority, Coroutine<T> coroutine,
+       std::promise<T> promise) -> Detached {
+      try {
+        co_await pool.schedule(priority);
+        if constexpr (std::is_void_v<T>) {
+          co_await std::move(coroutine);
+          promise.set_value();
+        }
+        else
+          promise.set_value(co_await std::move(coroutine));
+      }
+      catch (...) {
+        promise.set_exception(std::current_exception());
+      }
+    }(pool, priority, std::move(coroutine), std::move(promise));
+    return future;
+  }
+
+}
+
+#endif
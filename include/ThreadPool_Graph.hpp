@@ -0,0 +1,134 @@
+#ifndef THREADPOOL_GRAPH_HPP
+#define THREADPOOL_GRAPH_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <initializer_list>
+#include <mutex>
+#include <vector>
+#include "Task.hpp"
+#include "ThreadPool.hpp"
+
+namespace ThreadPool {
+
+  // Graph
+  //
+  // Set of tasks with dependencies among them (a DAG) executed by a pool.
+  // Every task declares which tasks it runs after and it is queued the very
+  // moment the last of them finishes, so no worker ever blocks waiting for
+  // its inputs.  Data flows through whatever the tasks capture, e.g.
+  //   Graph graph{pool};
+  //   auto load  = graph.add([&]() {text = load();});
+  //   auto parse = load.then([&]() {tree = parse(text);});
+  //   graph.add([&]() {check(tree, text);}, {load, parse});
+  //   graph.run();
+  //   graph.wait();
+  // Each task counts as one task of the pool, i.e. one step of the bars.
+  class Graph {
+   private:
+    template<typename R>
+    using IsInvocable = std::enable_if_t<std::is_invocable_v<R&>>;
+
+   public:
+    // Node
+    //
+    // Handle to a task of the graph, used to declare dependencies.
+    class Node {
+     public:
+      // then (function()) -> node
+      //
+      // Add a task to the graph that will execute function() after this one
+      template<typename R, typename=IsInvocable<R>>
+      Node then (R &&function) const;
+
+     private:
+      friend class Graph;
+      Node(Graph *graph, size_t index) : graph{graph}, index{index} {}
+
+      Graph  *graph;  // graph the task belongs to
+      size_t  index;  // position of the task in the graph
+    };
+
+    // constructor gets the pool and the priority level of all the tasks
+    Graph(Pool &pool, Priority priority=Priority::Normal);
+
+    // destructor waits for a running graph to finish
+    ~Graph();
+
+    // add (function(), after) -> node
+    //
+    // Add a task to the graph that will execute function()
+    //   function   :function to be called, it may be called again if the
+    //               graph is run again
+    //   after      :tasks that must be finished before this one starts
+    // Tasks must be added while the graph is not running.
+    template<typename R, typename=IsInvocable<R>>
+    Node add (R &&function, std::initializer_list<Node> after={});
+
+    // run ()
+    //
+    // Start executing the graph, queueing every task without predecessors.
+    // A finished graph may be run again from the start.
+    void run ();
+
+    // wait ()
+    //
+    // Wait until all tasks of the graph are finished, running tasks of the
+    // pool meanwhile (so it may be called from inside a task).  If a task
+    // throws, the tasks not started yet are skipped and its exception is
+    // rethrown here (Cancelled if the pool dropped one of the tasks).
+    void wait ();
+
+    // number of tasks in the graph
+    inline size_t size () const {return vertices.size();}
+
+   private:
+    // Vertex
+    //
+    // A task of the graph and its dependencies.
+    struct Vertex {
+      Vertex(Task &&task, size_t predecessors)
+          : task{std::move(task)}, predecessors{predecessors}, waiting{0} {}
+
+      Task                task;          // what is going to be executed
+      std::vector<size_t> successors;    // tasks that run after this one
+      size_t              predecessors;  // number of tasks it runs after
+      std::atomic<size_t> waiting;       // predecessors still running
+    };
+
+    // add a task that runs after the given ones, returns its node
+    Node  insert   (Task &&task, std::initializer_list<Node> after);
+
+    // queue a task whose predecessors are all finished
+    void  schedule (size_t index);
+
+    // execute a task and schedule the successors that became ready
+    void  execute  (size_t index);
+
+    Pool                   &pool;       // pool executing the tasks
+    Priority                priority;   // level of the tasks in the pool
+    std::deque<Vertex>      vertices;   // all tasks (never moved around)
+    std::atomic<size_t>     remaining;  // tasks not finished in this run
+    std::atomic<bool>       failed;     // whether a task has thrown
+    bool                    running;    // whether run() wasn't waited yet
+    bool                    finished;   // whether every task is finished
+    std::mutex              lock;       // guard finished and the exception
+    std::condition_variable done;       // signals the end of the run
+    std::exception_ptr      error;      // first exception thrown by a task
+  };
+
+  template<typename R, typename>
+  Graph::Node Graph::Node::then(R &&function) const {
+    return graph->add(std::forward<R>(function), {*this});
+  }
+
+  template<typename R, typename>
+  Graph::Node Graph::add(R &&function, std::initializer_list<Node> after) {
+    return insert(Task{std::forward<R>(function)}, after);
+  }
+
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef THREADPOOL_GROUP_HPP
+#define THREADPOOL_GROUP_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include "Progress.hpp"
+#include "ThreadPool.hpp"
+
+namespace ThreadPool {
+
+  // Tally
+  //
+  // Named progress shown as a bar of its own, see Bars::track().  It is
+  // shared with whoever shows it, as it may outlive what it counts.
+  struct Tally {
+    std::string       name;     // name shown beside the bar
+    Progress::Counter counter;  // steps done out of the steps known so far
+  };
+
+  // TaskGroup
+  //
+  // Set of tasks submitted to a pool through the group, which can be waited
+  // for on their own: independent batches (e.g. concurrent requests) share
+  // one pool without waiting for each other, e.g.
+  //   TaskGroup request{pool, "request 42"};
+  //   for (auto &item : items)
+  //     request.post([&item]() {process(item);});
+  //   request.wait();
+  // A group created from another one is nested in it: its tasks count as
+  // tasks of the outer group too, for waiting and for progress.  Bars shows
+  // a bar per group it tracks, see Bars::track().
+  class TaskGroup {
+   private:
+    template<typename ...T>
+    using IsInvocable = std::enable_if_t<std::is_invocable_v<T&&...>>;
+
+   public:
+    // constructor gets the pool running the tasks and a name for the bar
+    TaskGroup(Pool &pool, std::string_view name="");
+
+    // constructor of a group nested in another one, sharing its pool
+    TaskGroup(TaskGroup &parent, std::string_view name="");
+
+    // destructor waits for the tasks of the group to finish
+    ~TaskGroup();
+
+    TaskGroup(TaskGroup const &)            = delete;
+    TaskGroup& operator= (TaskGroup const &) = delete;
+
+    // execute (function(), ...args) -> future
+    //
+    // Create a new task of the group, see Pool::execute()
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    auto execute(R &&function, A &&...args) {
+      return execute(Priority::Normal, std::forward<R>(function),
+                     std::forward<A>(args)...);
+    }
+
+    // same as above at the given priority level
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    auto execute(Priority priority, R &&function, A &&...args);
+
+    // post (function(), ...args)
+    //
+    // Create a new task of the group without a future, see Pool::post()
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    void post(R &&function, A &&...args) {
+      post(Priority::Normal, std::forward<R>(function),
+           std::forward<A>(args)...);
+    }
+
+    // same as above at the given priority level
+    template<typename R, typename ...A, typename=IsInvocable<R, A...>>
+    void post(Priority priority, R &&function, A &&...args);
+
+    // wait ()
+    //
+    // Wait until every task of the group (and of nested groups) is
+    // finished.  Tasks of other groups are not waited for, but any of them
+    // may run on the calling thread meanwhile, so from inside a task it
+    // never deadlocks.
+    void wait ();
+
+    // number of tasks of the group (and of nested groups) not finished
+    inline size_t active () const {return running;}
+
+    // name of the group, as shown beside its bar
+    inline std::string const& name () const {return tally->name;}
+
+   private:
+    friend class Bars;
+
+    // account for n new tasks in the group and all the outer ones
+    void start  (size_t n);
+
+    // account for a finished task in the group and all the outer ones
+    void finish ();
+
+    // queue a task, undoing its accounting if the pool refuses it
+    void submit (Priority priority, Task &&task);
+
+    Pool                   &pool;     // pool executing the tasks
+    TaskGroup              *parent;   // outer group (if nested)
+    std::shared_ptr<Tally>  tally;    // tasks finished out of submitted
+    std::atomic<size_t>     running;  // tasks not finished yet
+    std::mutex              lock;     // guard the last finish
+    std::condition_variable done;     // signals that all are finished
+  };
+
+  template<typename R, typename ...A, typename>
+  auto TaskGroup::execute(Priority priority, R &&function, A &&...args) {
+    // the task is wrapped once more to account for it when it finishes,
+    // even if it is dropped (the pool still calls it, see Pool::discard())
+    auto task   = Pool::package(std::forward<R>(function),
+                                std::forward<A>(args)...);
+    auto future = task.get_future();
+    submit(priority, [this, task = std::move(task)]() mutable {
+      task();
+      finish();
+    });
+    return future;
+  }
+
+  template<typename R, typename ...A, typename>
+  void TaskGroup::post(Priority priority, R &&function, A &&...args) {
+    using namespace std;
+    submit(priority, [
+      this,
+      function = forward<R>(function),
+      args     = make_tuple(forward<A>(args)...)
+    ] () mutable {
+      if (!Pool::discarding) {
+        try {
+          apply(move(function), move(args));
+        }
+        catch (...) {
+          // nobody is listening, an exception must not kill the worker
+        }
+      }
+      finish();
+    });
+  }
+
+}
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef THREADPOOL_PIPELINE_HPP
+#define THREADPOOL_PIPELINE_HPP
+
+#include <any>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "ThreadPool.hpp"
+#include "ThreadPool_Group.hpp"
+
+namespace ThreadPool {
+
+  // Pipeline
+  //
+  // Chain of stages that items go through one after the other, every stage
+  // running as tasks of a pool, e.g.
+  //   Pipeline pipeline{pool};
+  //   pipeline.source("read", [&]() {return read_line(file);})
+  //           .stage("parse", [](std::string line) {return parse(line);})
+  //           .stage("write", [&](Record record) {write(record);},
+  //                  1, Pipeline::Source);
+  //   pipeline.run();
+  // The source is called again and again (one call at a time) until it
+  // returns an empty optional, each stage gets the result of the previous
+  // one.  A stage runs up to 'parallelism' items at once, and those of a
+  // stage in Source order start in the order the source produced them (so
+  // with a parallelism of 1 they also finish in that order).  Only the last
+  // stage may return nothing.  Items
+  // in flight are bounded by the capacity of the pipeline, which bounds the
+  // queue in front of every stage: a slow stage holds the source back, and
+  // gets as many workers as its parallelism allows.
+  class Pipeline {
+   public:
+    // Order
+    //
+    // Order in which the items of a stage start.
+    enum Order {
+      Arrival,  // as soon as they come out of the previous stage
+      Source,   // in the order the source produced them
+    };
+
+    // constructor gets the pool running the stages and the number of items
+    // in flight at most (twice the threads of the pool if 0)
+    Pipeline(Pool &pool, size_t capacity=0);
+
+    // source (name, function()) -> pipeline
+    //
+    // Set the first stage (before any other), calling function() ->
+    // optional<T> for each new item until it returns an empty optional
+    template<typename F>
+    Pipeline& source (std::string_view name, F &&function);
+
+    // stage (name, function(), parallelism, order) -> pipeline
+    //
+    // Add a stage calling function(item) for every item coming out of the
+    // previous one, its result goes on to the next stage
+    //   name         :name of the stage, shown beside its bar
+    //   function     :function of a single argument, not a template, that
+    //                 may return void only if it is the last stage
+    //   parallelism  :items processed at once at most (0 for no limit)
+    //   order        :order in which the items start
+    // Throws std::invalid_argument if the previous stage returns void.
+    template<typename F>
+    Pipeline& stage  (std::string_view name, F &&function,
+                      size_t parallelism=0, Order order=Arrival);
+
+    // run ()
+    //
+    // Push every item of the source through all stages and wait until the
+    // last one is finished, running tasks of the pool meanwhile if called
+    // from inside a task.  If a stage throws, no new items start and the
+    // first exception is rethrown here (Cancelled if the pool dropped one).
+    void run ();
+
+    // number of stages, source included
+    inline size_t size () const {return stages.size();}
+
+   private:
+    friend class Bars;
+
+    // Item
+    //
+    // Value on its way between two stages and its place in the source.
+    struct Item {
+      size_t   index;  // number of the item, in order of the source
+      std::any value;  // result of the previous stage
+    };
+
+    // Stage
+    //
+    // Function of a stage and the items waiting for it.
+    struct Stage {
+      std::function<std::any(std::any &)> function;  // the work (or source)
+      size_t                 limit;    // items processed at once at most
+      bool                   ordered;  // whether items start in order
+      bool                   yields;   // whether it returns something
+      std::deque<Item>       queue;    // items waiting for this stage
+      size_t                 running;  // items being processed
+      size_t                 next;     // next item in order (if ordered)
+      std::shared_ptr<Tally> tally;    // items done out of items produced
+    };
+
+    // extract the argument type of a function of a single argument
+    template<typename R, typename A>
+    static A argument (std::function<R(A)>);
+
+    // add a stage running 'function' on its items
+    Pipeline& add    (std::string_view name,
+                      std::function<std::any(std::any &)> &&function,
+                      size_t parallelism, Order order, bool yields);
+
+    // choose the items that can start now, with the lock held
+    void      pump   (std::vector<Item> &items, std::vector<size_t> &which);
+
+    // start the chosen items as tasks of the pool, without the lock
+    void      launch (std::vector<Item> &items, std::vector<size_t> &which);
+
+    // process an item through stage i and move it on to the next one
+    void      work   (size_t i, Item &item);
+
+    Pool                   &pool;       // pool executing the stages
+    size_t                  capacity;   // items in flight at most
+    std::deque<Stage>       stages;     // source and stages, in order
+    size_t                  produced;   // items produced by the source
+    size_t                  completed;  // items out of the last stage
+    bool                    exhausted;  // whether the source is done
+    bool                    failed;     // whether a stage has thrown
+    std::exception_ptr      error;      // first exception thrown
+    std::mutex              lock;       // guard the state of the run
+    TaskGroup               tasks;      // tasks of the stages (last member,
+                                        // waited for before the rest goes)
+  };
+
+  template<typename F>
+  Pipeline& Pipeline::source(std::string_view name, F &&function) {
+    using namespace std;
+    // the source gets nothing and returns an empty value once it's done
+    return add(name, [function = forward<F>(function)](any &) mutable {
+      auto value = function();
+      return value ? any{std::move(*value)} : any{};
+    }, 1, Source, true);
+  }
+
+  template<typename F>
+  Pipeline& Pipeline::stage(std::string_view name, F &&function,
+                            size_t parallelism, Order order) {
+    using namespace std;
+    using input  = decay_t<decltype(argument(std::function{function}))>;
+    using output = invoke_result_t<F&, input>;
+    return add(name, [function = forward<F>(function)](any &value) mutable {
+      auto item = any_cast<input>(std::move(value));
+      if constexpr (is_void_v<output>) {
+        function(std::move(item));
+        return any{};
+      }
+      else
+        return any{function(std::move(item))};
+    }, parallelism, order, !is_void_v<output>);
+  }
+
+}
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef THREADPOOL_SINK_HPP
+#define THREADPOOL_SINK_HPP
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ThreadPool {
+
+  // Snapshot
+  //
+  // Progress of a pool at one refresh of Bars, as handed to a Sink.  The
+  // rate is smoothed over the last few seconds, so the ETA doesn't jump
+  // around with every task that finishes.
+  struct Snapshot {
+    // Bar
+    //
+    // Progress of the counter of one thread.
+    struct Bar {
+      long   worker;    // index of the worker, -1 for threads outside
+      double fraction;  // [0, 1] progress of its current counter
+    };
+
+    // Group
+    //
+    // Progress of a task group (or a pipeline stage) tracked by the bars.
+    struct Group {
+      std::string name;   // name of the group
+      long        done;   // tasks of the group finished
+      long        tasks;  // tasks of the group submitted
+    };
+
+    double             elapsed;   // seconds since tracking started
+    long               done;      // tasks finished
+    long               tasks;     // tasks submitted
+    double             fraction;  // [0, 1] total progress, partial too
+    double             rate;      // tasks finished per second (smoothed)
+    double             eta;       // seconds left at that rate, -1 unknown
+    std::vector<Bar>   bars;      // progress of every thread with a counter
+    std::vector<Group> groups;    // progress of tracked groups, then stages
+    std::string        message;   // message of the total bar
+    bool               finished;  // whether it's the last one of the round
+  };
+
+  // Sink
+  //
+  // Destination of the progress tracked by Bars, e.g. a log or a metrics
+  // system instead of a terminal.  It is called by the tracker thread only,
+  // once per refresh, see Refresh::report.
+  class Sink {
+   public:
+    virtual ~Sink () = default;
+
+    // receive the progress at this refresh
+    virtual void report (Snapshot const &snapshot) = 0;
+  };
+
+  // JsonLines
+  //
+  // Sink writing every snapshot as a single JSON object per line, e.g.
+  //   {"elapsed":2.5,"done":40,"tasks":100,"fraction":0.41,"rate":16.2,
+  //    "eta":3.64,"bars":[{"worker":0,"fraction":0.5}],
+  //    "groups":[{"name":"a","done":3,"tasks":8}],"message":"",
+  //    "finished":false}
+  // to a file descriptor or to a function receiving each line.
+  class JsonLines : public Sink {
+   public:
+    // write lines to a file descriptor (which is not closed)
+    JsonLines(int fd);
+
+    // hand lines (with their '\n') to a function
+    JsonLines(std::function<void(std::string_view)> output);
+
+    void report (Snapshot const &snapshot) override;
+
+   private:
+    std::function<void(std::string_view)> output;  // where lines go
+    std::string                           line;    // reused buffer
+  };
+
+}
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef TIMERWHEEL_HPP
+#define TIMERWHEEL_HPP
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include "Task.hpp"
+
+namespace ThreadPool {
+
+  // TimerWheel
+  //
+  // Tasks waiting for a point in time, kept in a hierarchical timing wheel:
+  // time goes by in ticks, and each level is a ring of slots, the first one
+  // a slot per tick, every next one a slot per revolution of the previous.
+  // A task goes to the slot of its tick in the lowest level that reaches
+  // it, and moves down a level each time the level below comes around to
+  // it.  Adding a task and advancing a tick cost the same no matter how
+  // many tasks are waiting.  It is not thread-safe: the owner guards it.
+  class TimerWheel {
+   public:
+    using clock = std::chrono::steady_clock;
+
+    // Timer
+    //
+    // Task waiting in the wheel, and the tick at which it is due.
+    struct Timer {
+      uint64_t due;   // tick when it is due
+      Task     task;  // what is going to be executed
+    };
+
+    // constructor gets the duration of a tick, starting to count from now
+    TimerWheel(clock::duration tick=std::chrono::milliseconds{1});
+
+    // number of tasks waiting
+    inline size_t size  () const {return count;}
+
+    // returns true if there are no tasks waiting
+    inline bool   empty () const {return !count;}
+
+    // add a task due at the given time (at the next tick if already passed)
+    void add     (clock::time_point when, Task &&task);
+
+    // advance (now, expired)
+    //
+    // Advance the wheel up to the given time, appending every task that
+    // became due to 'expired', in order.
+    void advance (clock::time_point now, std::vector<Task> &expired);
+
+    // time of the next tick with something to do (due tasks or tasks to
+    // move down a level), time_point::max() if nothing is waiting
+    clock::time_point next () const;
+
+    // take every waiting task out of the wheel
+    void clear   (std::vector<Task> &taken);
+
+   private:
+    static constexpr size_t bits   = 6;          // log2 of slots per level
+    static constexpr size_t slots  = 1 << bits;  // slots per level
+    static constexpr size_t levels = 4;          // levels of the wheel
+
+    using Slot = std::vector<Timer>;
+
+    // ticks from the start to a point in time, rounded down
+    uint64_t ticks   (clock::time_point when) const;
+
+    // place a timer in the slot of its tick, in the lowest level reaching it
+    void     place   (Timer &&timer);
+
+    clock::time_point start;    // time of tick 0
+    clock::duration   tick;     // duration of a tick
+    uint64_t          current;  // last tick processed
+    size_t            count;    // number of tasks waiting
+    std::array<std::array<Slot, slots>, levels> wheel;  // slots of levels
+  };
+
+}
+
+#endif
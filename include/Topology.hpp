@@ -0,0 +1,58 @@
+#ifndef TOPOLOGY_HPP
+#define TOPOLOGY_HPP
+
+#include <cstddef>
+#include <vector>
+
+namespace ThreadPool {
+
+  // Cpu
+  //
+  // A logical cpu and where it sits in the machine.
+  struct Cpu {
+    int id;    // number of the logical cpu, as used by the kernel
+    int core;  // physical core (lowest id among its hyperthreads)
+    int node;  // NUMA node
+  };
+
+  // Affinity
+  //
+  // Where the workers of a pool run:
+  //   Free   :anywhere, the scheduler moves them around as it pleases
+  //   Cpus   :each worker pinned to one cpu, taken in order from 'cpus'
+  //           (or all cpus available to the process if empty)
+  //   Cores  :each worker pinned to a different physical core, extra
+  //           workers go to the remaining hyperthreads
+  // Pinned workers are grouped by NUMA node: a task submitted from outside
+  // the pool goes to a worker on the same node as the submitting thread, and
+  // idle workers steal from their own node first.  Where the topology or
+  // pinning isn't available (e.g. not Linux), workers simply run Free.
+  struct Affinity {
+    enum Mode {Free, Cpus, Cores};
+
+    Mode             mode = Free;  // how to place the workers
+    std::vector<int> cpus;         // cpus to use in mode Cpus
+  };
+
+  // topology () -> cpus
+  //
+  // Logical cpus the calling process may run on, read from sysfs.  Missing
+  // information defaults to each cpu being its own core on node 0.
+  std::vector<Cpu> topology ();
+
+  // placement (n, affinity) -> cpus
+  //
+  // Choose the cpus of n workers according to affinity, sorted by node so
+  // that workers of the same node are neighbours.  Returns an empty list if
+  // workers should not be pinned.
+  std::vector<Cpu> placement (size_t n, Affinity const &affinity);
+
+  // pin the calling thread to the given cpu, returns false if it can't
+  bool pin (int cpu);
+
+  // cpu the calling thread is running on, -1 if unknown
+  int  current_cpu ();
+
+}
+
+#endif
@@ -1,14 +1,24 @@
 #include "Progress.hpp"
 
-#include <string>
-#include <iomanip>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
 #include <iostream>
+#include <unistd.h>
 
 using namespace std;
 
 namespace Progress {
 
   std::ostream& Bar(double fraction, int width) {
+    // build the whole bar first, so it is sent to the stream in one go
+    thread_local string line;
+    line.clear();
+    Bar(line, fraction, width);
+    return cout << '\r' << line;
+  }
+
+  void Bar(std::string &line, double fraction, int width) {
     // the characters we need to build a pretty progress bar
     static string const bar[]  {"▏", "▎", "▍", "▌", "▋", "▊", "▉", "█"};
     // clear the line after cursor position
@@ -24,23 +34,116 @@ namespace Progress {
     fill /= 8;
 
     // print a prefix with percentage number
-    cout << '\r' << setw(5) << perc << "% │" << setcolor;
+    char prefix[8];
+    snprintf(prefix, sizeof(prefix), "%5d", perc);
+    line += prefix;
+    line += "% │";
+    line += setcolor;
 
     // print the completely filled characters
     for (int i{0}; i < fill; ++i)
-      cout << bar[7];
+      line += bar[7];
 
     // now there's one partially filled character
-    cout << bar[part];
+    line += bar[part];
 
     // all the rest are empty characters
-    for (int i{0}; i < width - fill - 1; ++i)
-      cout << ' ';
+    line.append(max(0, width - fill - 1), ' ');
 
     // print the suffix of the bar
-    cout << unsetcolor << "│ " << clearline;
+    line += unsetcolor;
+    line += "│ ";
+    line += clearline;
+  }
+
+  std::string& Screen::line() {
+    // lines are reused from frame to frame to keep their memory
+    if (nlines == lines.size())
+      lines.emplace_back();
+    auto &line = lines[nlines++];
+    line.clear();
+    return line;
+  }
+
+  void Screen::raw(std::string_view sequence) {
+    buffer += sequence;
+  }
+
+  void Screen::draw() {
+    // the row the cursor is at, relative to the first line
+    size_t row{0};
+
+    // move cursor to the beginning of a given row below the current one,
+    // rows that were never used on the screen are created with new lines
+    auto move_to = [&](size_t target) {
+      size_t existing = min(target, max(rows, size_t{1}) - 1);
+      if (existing > row)
+        buffer += "\33[" + to_string(existing - row) + 'E';
+      else
+        buffer += '\r';
+      buffer.append(target - max(existing, row), '\n');
+      row  = target;
+      rows = max(rows, row + 1);
+    };
+
+    // rewrite only the lines which are different from what's on the screen
+    previous.resize(max(previous.size(), nlines));
+    for (size_t i{0}; i < nlines; ++i) {
+      if (i < rows && lines[i] == previous[i])
+        continue;
+      move_to(i);
+      buffer += lines[i];
+      previous[i] = lines[i];
+    }
+
+    // lines left over from a longer frame are erased
+    if (nlines < rows && any_of(previous.begin() + nlines, previous.end(),
+                                [](auto &line) {return !line.empty();})) {
+      move_to(nlines);
+      buffer += "\33[J";
+      for (size_t i{nlines}; i < previous.size(); ++i)
+        previous[i].clear();
+    }
+
+    // go back to the beginning of the first line
+    if (row > 0)
+      buffer += "\33[" + to_string(row) + 'F';
+    else if (!buffer.empty())
+      buffer += '\r';
+
+    nlines = 0;
+    flush();
+  }
+
+  void Screen::close() {
+    // skip to the line after the last row used by the frames
+    if (rows > 1)
+      buffer += "\33[" + to_string(rows - 1) + 'E';
+    if (rows > 0)
+      buffer += '\n';
+    flush();
+
+    previous.clear();
+    nlines = rows = 0;
+  }
+
+  void Screen::flush() {
+    // anything written through the standard streams must go out first
+    cout.flush();
 
-    return cout;
+    // a single write() in general, unless interrupted or partially written
+    size_t sent{0};
+    while (sent < buffer.size()) {
+      auto n = ::write(fd, buffer.data() + sent, buffer.size() - sent);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        break;
+      sent += n;
+      ++writes;
+    }
+    written += sent;
+    buffer.clear();
   }
 
 }
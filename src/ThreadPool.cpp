@@ -3,68 +3,940 @@ using namespace std;
 
 namespace ThreadPool {
 
-  Pool::Pool(size_t nthreads) : done{false}, processing{0} {
-    // start up all the nthreads that will be waiting for jobs
-    while (nthreads --> 0) // the cutest syntax abuse of all of C++
-      // we add a new thread to our list of threads using a lambda function
-      threads.emplace_back(thread{[this]() {
-        Task task;
-        // it will run forever until explicitly asked to stop
-        while (true) {
-          // protect the queue from racing conditions in this block
-          {
-            unique_lock lock{queue_lock};
-
-            // wait for tasks to be added to queue or finish
-            queued.wait(lock, [this]() -> bool {
-              // move on if there are more tasks or if we are finished
-              return !tasks.empty() || done;
-            });
-
-            // before processing more tasks, check if we want to stop
-            if (done)
-              return;
-
-            // acquire one task
-            task = std::move(tasks.front());
-            tasks.pop();
-            ++processing;
-          }
-
-          // execute task
-          task();
-
-          // protect the hook execution and the counter
-          {
-            unique_lock lock{queue_lock};
-            if (hook_dequeue)
-              hook_dequeue();
-            --processing;
-          }
-
-          // notify that a task was removed from queue
-          dequeued.notify_one();
+  // pool, worker index and priority level of the task being run by the
+  // current thread (if it is a worker)
+  thread_local Pool   *current_pool   = nullptr;
+  thread_local size_t  current_worker = 0;
+  thread_local size_t  current_level  = size_t(Priority::Normal);
+
+  // pool whose task the current thread is running (worker or not)
+  thread_local Pool   *performing     = nullptr;
+
+  // number of tasks the current thread is running, one inside the other
+  thread_local size_t  task_depth     = 0;
+
+  using clock = chrono::steady_clock;
+
+  // nanoseconds elapsed between two points in time
+  static uint64_t nanoseconds(clock::time_point from, clock::time_point to) {
+    return chrono::duration_cast<chrono::nanoseconds>(to - from).count();
+  }
+
+  // add to a counter with a single writer, no need for an atomic increment
+  static void add(atomic<uint64_t> &counter, uint64_t n) {
+    counter.store(counter.load(memory_order_relaxed) + n,
+                  memory_order_relaxed);
+  }
+
+  // hint the cpu that we are spinning, waiting for something to change
+  static void relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+
+  // time since the clock's epoch, to be kept in an atomic integer
+  static int64_t ticks(clock::time_point time) {
+    return time.time_since_epoch().count();
+  }
+
+  // time elapsed since the given ticks
+  static clock::duration since(clock::time_point now, int64_t ticks) {
+    return now - clock::time_point{clock::duration{ticks}};
+  }
+
+  Pool::Pool(size_t nthreads, Affinity affinity)
+      : Pool{Elastic{nthreads, nthreads}, affinity} {}
+
+  Pool::Pool(Elastic bounds, Affinity affinity)
+      : done{false}, closed{false}, pending{0}, capacity{0}
+      , overflow{Overflow::Block}, blocked{0}
+      , waiting{}, processing{0}, sleeping{0}
+      , next{0}
+      , hooked{false}, hooking{0}, measuring{false}, contended{0}
+      , bounds{bounds}
+      , live{0}, dequeued_at{0}, nested{0}, waiters{0}
+      , parked{0}, wakeups{0}, idling{{Idle{}.spins}, {Idle{}.yields}}
+      , next_timer{numeric_limits<int64_t>::max()}, keeping{false} {
+    // there is always room for at least one thread
+    this->bounds.max = max<size_t>(1, bounds.max);
+    this->bounds.min = min(bounds.min, this->bounds.max);
+    elastic = this->bounds.min < this->bounds.max;
+    size_t nthreads = this->bounds.max;
+
+    // every thread has its own queue, created before any thread starts,
+    // and maybe a cpu (in which case workers come sorted by node)
+    auto cpus = placement(nthreads, affinity);
+    for (size_t i{0}; i < nthreads; ++i) {
+      auto &worker = *workers.emplace_back(make_unique<Worker>());
+      if (!cpus.empty()) {
+        worker.cpu  = cpus[i].id;
+        worker.node = cpus[i].node;
+      }
+      if (groups.empty() ||
+          workers[groups.back().front()]->node != worker.node)
+        groups.emplace_back();
+      groups.back().push_back(i);
+    }
+
+    // thieves go for the workers of their own node first, in a different
+    // order for each thief so that they don't all fall on the same victim
+    for (auto &group : groups)
+      for (size_t i{0}; i < group.size(); ++i) {
+        auto &victims = workers[group[i]]->victims;
+        for (size_t j{1}; j < group.size(); ++j)
+          victims.push_back(group[(i + j) % group.size()]);
+        for (size_t j{1}; j < nthreads; ++j) {
+          size_t victim = (group[i] + j) % nthreads;
+          if (workers[victim]->node != workers[group[i]]->node)
+            victims.push_back(victim);
         }
-      }});
+      }
+
+    // outsiders submit to workers on their node, if workers span many
+    if (groups.size() > 1)
+      for (auto &cpu : topology()) {
+        if (size_t(cpu.id) >= group_of.size())
+          group_of.resize(cpu.id + 1, -1);
+        for (size_t g{0}; g < groups.size(); ++g)
+          if (workers[groups[g].front()]->node == cpu.node)
+            group_of[cpu.id] = g;
+      }
+
+    // start up the threads that will be waiting for jobs, others may come
+    // later if elastic
+    threads.resize(nthreads);
+    while (live < this->bounds.min)
+      spawn();
   }
 
   Pool::~Pool() {
-    // signal all threads to finish immediately
-    done = true;
+    shutdown(Shutdown::Drain);
+  }
+
+  void Pool::shutdown(Shutdown mode) {
+    // when discarding, tasks queued by those still running are dropped as
+    // well, otherwise they run until there is nothing left
+    if (mode == Shutdown::Discard) {
+      closed = true;
+      disarm();
+      cancel_pending();
+    }
+    wait();
+    closed = true;
+    disarm();
+
+    {
+      // signal all threads to finish
+      unique_lock _{queue_lock};
+      done = true;
+    }
     queued.notify_all();
+    ++wakeups;
+    wakeups.notify_all();
+
+    // no more threads are spawned once done, past the spawns in progress
+    { unique_lock _{grow_lock}; }
 
     // wait for joining back all threads
     for (auto &thread : threads)
       if (thread.joinable())
         thread.join();
+
+    // tasks that slipped in meanwhile never run, but their futures still
+    // get an answer
+    cancel_pending();
+  }
+
+  size_t Pool::cancel_pending() {
+    // take every queued job out at once, so that the pool doesn't run them
+    // while we are dropping the others
+    vector<Job> jobs;
+    Job         job;
+    for (auto &worker : workers) {
+      auto _ = acquire(worker->lock, worker->counters.contended);
+      for (size_t level{0}; level < levels; ++level)
+        while (take(*worker, level, false, job))
+          jobs.push_back(std::move(job));
+    }
+    if (jobs.empty())
+      return 0;
+
+    // they are processed (and finished) rather than queued from now on
+    processing += jobs.size();
+    pending    -= jobs.size();
+    if (blocked)
+      pending.notify_all();
+    size_t dropped{0};
+    for (auto &job : jobs) {
+      dropped += job.weight;
+      discard(job);
+    }
+    if ((processing -= jobs.size()) <= nested && !pending) {
+      { auto _ = acquire(queue_lock, contended); }
+      dequeued.notify_all();
+    }
+    return dropped;
+  }
+
+  void Pool::discard(Job &job) {
+    // helpers of parallel_for() (weight 0) are simply dropped, the thread
+    // waiting for the loop takes care of every chunk anyway
+    bool outer = exchange(discarding, true);
+    if (job.weight)
+      job.task();
+    job.task.reset();
+    discarding = outer;
+
+    // they count as finished for whoever follows the progress
+    if (job.weight)
+      dequeue_hook(job.weight);
   }
 
   void Pool::wait() {
-    unique_lock lock{queue_lock};
-    dequeued.wait(lock, [this]() -> bool {
-      // move on only if tasks queue is empty and no task is being processed
-      return tasks.empty() && !processing;
-    });
+    // a thread waiting from inside a task is itself processing a task, and
+    // so is any other thread doing the same: those don't count for it
+    bool inside = performing == this;
+    if (inside)
+      ++nested;
+    ++waiters;
+    auto idle = [this, inside]() -> bool {
+      return !pending && processing <= (inside ? nested.load() : 0);
+    };
+
+    // move on only if tasks queue is empty and no task is being processed,
+    // running the queued tasks ourselves meanwhile
+    for (;;) {
+      if (help())
+        continue;
+      unique_lock lock{queue_lock};
+      dequeued.wait(lock, [&]() -> bool {return pending || idle();});
+      if (idle())
+        break;
+    }
+
+    --waiters;
+    if (inside)
+      --nested;
+  }
+
+  bool Pool::help() {
+    if (!pending)
+      return false;
+
+    // workers look in their own queue first, as usual
+    Job    job;
+    size_t level;
+    if (current_pool == this) {
+      if (!pop(current_worker, job, level))
+        return false;
+      perform(job, level, &workers[current_worker]->counters);
+      return true;
+    }
+
+    // anyone else steals the oldest task of the highest level
+    for (level = 0; level < levels; ++level)
+      for (size_t i{0}; i < live && waiting[level]; ++i) {
+        auto &worker = *workers[i];
+        unique_lock lock{worker.lock};
+        if (take(worker, level, false, job)) {
+          lock.unlock();
+          perform(job, level, nullptr);
+          return true;
+        }
+      }
+    return false;
+  }
+
+  long Pool::thread_index() const {
+    return current_pool == this ? long(current_worker) : -1;
+  }
+
+  size_t Pool::depth() {
+    return task_depth;
+  }
+
+  Stats Pool::stats() const {
+    Stats stats;
+    stats.contended = contended.load(memory_order_relaxed);
+    stats.helped    = outsiders.tasks.load(memory_order_relaxed);
+    stats.helping   = chrono::nanoseconds(
+      outsiders.busy.load(memory_order_relaxed));
+    for (size_t i{0}; i < Histogram::nbuckets; ++i) {
+      stats.wait.buckets[i] = outsiders.wait[i].load(memory_order_relaxed);
+      stats.run.buckets[i]  = outsiders.run[i].load(memory_order_relaxed);
+    }
+    for (auto &worker : workers) {
+      auto &counters = worker->counters;
+      stats.workers.push_back({
+        counters.tasks.load(memory_order_relaxed),
+        counters.steals.load(memory_order_relaxed),
+        chrono::nanoseconds(counters.busy.load(memory_order_relaxed)),
+        chrono::nanoseconds(counters.idle.load(memory_order_relaxed)),
+      });
+      stats.contended += counters.contended.load(memory_order_relaxed);
+      for (size_t i{0}; i < Histogram::nbuckets; ++i) {
+        stats.wait.buckets[i] += counters.wait[i].load(memory_order_relaxed);
+        stats.run.buckets[i]  += counters.run[i].load(memory_order_relaxed);
+      }
+    }
+    return stats;
+  }
+
+  unique_lock<mutex> Pool::acquire(mutex &mutex, atomic<uint64_t> &count) {
+    unique_lock lock{mutex, try_to_lock};
+    if (!lock) {
+      count.fetch_add(1, memory_order_relaxed);
+      lock.lock();
+    }
+    return lock;
+  }
+
+  void Pool::enqueue(Priority priority, Task &&task) {
+    // a full queue holds the task back (or rejects it) before it counts
+    Job job{std::move(task), 1};
+    if (full() && !make_room())
+      return run_here(size_t(priority), &job, 1);
+
+    // execute the enqueue hook if there is one, before the task can run and
+    // be accounted as dequeued
+    enqueue_hook(1);
+
+    // hand the task over to one of the workers
+    push(size_t(priority), &job, 1);
+  }
+
+  void Pool::enqueue(Priority priority, vector<Job> &&jobs) {
+    if (jobs.empty())
+      return;
+    if (full() && !make_room())
+      return run_here(size_t(priority), jobs.data(), jobs.size());
+
+    // execute the enqueue hook only once for the whole batch
+    enqueue_hook(jobs.size());
+
+    // hand all the tasks over to one of the workers, others will steal them
+    push(size_t(priority), jobs.data(), jobs.size());
+  }
+
+  bool Pool::try_enqueue(Priority priority, Task &&task) {
+    if (full())
+      return false;
+    enqueue_hook(1);
+    Job job{std::move(task), 1};
+    push(size_t(priority), &job, 1);
+    return true;
+  }
+
+  bool Pool::full() const {
+    // tasks of the pool itself are never held back, the workers would end
+    // up waiting for themselves
+    size_t limit = capacity.load(memory_order_relaxed);
+    return limit && current_pool != this && performing != this &&
+           pending >= limit;
+  }
+
+  bool Pool::make_room() {
+    switch (overflow.load(memory_order_relaxed)) {
+      case Overflow::Fail:  throw QueueFull{};
+      case Overflow::Run:   return false;
+      case Overflow::Block: break;
+    }
+
+    // every task dequeued wakes us up to check again while we are blocked,
+    // this check and the one in perform() can't both miss the other's
+    // update
+    ++blocked;
+    for (;;) {
+      size_t seen = pending, limit = capacity;
+      if (!limit || seen < limit || closed)
+        break;
+      pending.wait(seen);
+    }
+    --blocked;
+    return true;
+  }
+
+  void Pool::run_here(size_t level, Job *jobs, size_t n) {
+    // they count as queued and dequeued at once, as any other task
+    enqueue_hook(n);
+    pending += n;
+    for (size_t i{0}; i < n; ++i)
+      perform(jobs[i], level, nullptr);
+  }
+
+  void Pool::push(size_t level, Job *jobs, size_t n) {
+    // a pool shutting down doesn't take any more tasks
+    if (closed) {
+      for (size_t i{0}; i < n; ++i)
+        discard(jobs[i]);
+      return;
+    }
+
+    // one timestamp for the whole batch, and only when someone looks at it
+    auto now = clock::time_point{};
+    if (elastic || timing()) {
+      now = clock::now();
+      for (size_t i{0}; i < n; ++i)
+        jobs[i].queued = now;
+    }
+
+    // workers keep their own tasks, everyone else distributes them evenly
+    // among the running workers (trying again if one retires meanwhile)
+    for (bool pushed{false}; !pushed;) {
+      if (current_pool != this && !live)
+        spawn();
+      auto &worker = current_pool == this
+        ? *workers[current_worker]
+        : *workers[pick()];
+
+      auto _ = acquire(worker.lock, worker.counters.contended);
+      if ((pushed = worker.alive)) {
+        auto &queue = current_pool == this
+          ? worker.tasks[level]
+          : worker.inbox[level];
+        for (size_t i{0}; i < n; ++i)
+          queue.push_back(std::move(jobs[i]));
+        waiting[level] += n;
+      }
+    }
+
+    // only bother the sleeping threads if there is anyone sleeping, this
+    // check and the one in run() can't both miss the other's increment,
+    // same for those waiting on the pool (which help with the new tasks)
+    pending += n;
+    if (waiters) {
+      { auto _ = acquire(queue_lock, contended); }
+      dequeued.notify_all();
+    }
+    size_t parked = this->parked, asleep = sleeping;
+    // wake up just enough threads to take all the new tasks, those parked
+    // on the atomic first as they are the cheapest to wake up
+    if (parked) {
+      ++wakeups;
+      if (n >= parked)
+        wakeups.notify_all();
+      else for (size_t i{0}; i < n; ++i)
+        wakeups.notify_one();
+    }
+    if (asleep && n > parked) {
+      { auto _ = acquire(queue_lock, contended); }
+      if (n - parked >= asleep)
+        queued.notify_all();
+      else for (size_t i{parked}; i < n; ++i)
+        queued.notify_one();
+    }
+
+    // with every thread busy and nothing dequeued for a while, tasks are
+    // waiting too long: time for another thread
+    if (!parked && !asleep && elastic && live < bounds.max &&
+             since(now, dequeued_at.load(memory_order_relaxed)) > bounds.wait)
+      spawn();
+  }
+
+  size_t Pool::pick() {
+    // only workers [0, live) are running, at least one of them
+    size_t running = max<size_t>(1, live);
+
+    // look up the node of the calling thread only if it makes a difference
+    if (groups.size() > 1) {
+      int cpu = current_cpu();
+      if (cpu >= 0 && size_t(cpu) < group_of.size() && group_of[cpu] >= 0) {
+        auto &group = groups[group_of[cpu]];
+        size_t n = lower_bound(group.begin(), group.end(), running)
+                 - group.begin();
+        if (n)
+          return group[next++ % n];
+      }
+    }
+    return next++ % running;
+  }
+
+  void Pool::spawn() {
+    unique_lock _{grow_lock};
+    size_t self = live;
+    if (done || self >= bounds.max)
+      return;
+
+    // the previous thread of this worker (if any) is already on its way out
+    if (threads[self].joinable())
+      threads[self].join();
+    {
+      auto &worker = *workers[self];
+      unique_lock _{worker.lock};
+      worker.alive = true;
+      ++worker.generation;
+    }
+    ++live;
+
+    // don't grow again before the new thread had a chance to help
+    dequeued_at.store(ticks(clock::now()), memory_order_relaxed);
+    threads[self] = thread{[this, self]() {
+      run(self);
+    }};
+  }
+
+  bool Pool::retire(size_t self) {
+    unique_lock _{grow_lock};
+    if (self + 1 != live || live <= bounds.min || done)
+      return false;
+
+    // nobody can push to a worker that is not alive, so an empty queue now
+    // stays empty
+    auto &worker = *workers[self];
+    unique_lock lock{worker.lock};
+    for (size_t level{0}; level < levels; ++level)
+      if (!worker.tasks[level].empty() || !worker.inbox[level].empty())
+        return false;
+    worker.alive = false;
+    --live;
+    return true;
+  }
+
+  void Pool::for_each_chunk(Range::Args range,
+                            function<void(long, long)> const &function) {
+    auto loop = make_shared<Loop>(range, function);
+    if (!loop->chunks)
+      return;
+
+    // every chunk is accounted as a task by the hooks
+    enqueue_hook(loop->chunks);
+
+    // helpers are free riders (weight 0) as their chunks are accounted for
+    // separately, and we don't need more helpers than remaining chunks
+    vector<Job> helpers(min(size(), loop->chunks - 1));
+    for (auto &helper : helpers)
+      helper = {[this, loop]() {work(*loop);}, 0};
+    // and they help at the same priority level as whoever is waiting
+    if (!helpers.empty())
+      push(current_pool == this ? current_level : size_t(Priority::Normal),
+           helpers.data(), helpers.size());
+
+    // the calling thread works too, then waits for the chunks of others
+    work(*loop);
+    for (size_t done; (done = loop->done) < loop->chunks;)
+      loop->done.wait(done);
+
+    if (loop->error)
+      rethrow_exception(loop->error);
+  }
+
+  void Pool::work(Loop &loop) {
+    long begin, end;
+    while (loop.range.next(begin, end)) {
+      // after the first error the remaining chunks are just skipped
+      if (!loop.failed) {
+        try {
+          (*loop.function)(begin, end);
+        }
+        catch (...) {
+          unique_lock _{loop.lock};
+          if (!loop.failed.exchange(true))
+            loop.error = current_exception();
+        }
+      }
+
+      // report progress of this chunk and wake up the caller if last one
+      dequeue_hook(1);
+      if (++loop.done == loop.chunks)
+        loop.done.notify_all();
+    }
+  }
+
+  Pool::Range::Range(Args args)
+      : position{get<0>(args)}, last{get<1>(args)}, chunk{get<3>(args)}
+      , nthreads{max<long>(1, get<4>(args))}, schedule{get<2>(args)} {
+    long n = max(0l, last - position);
+    // default chunk sizes: one part per thread for a static schedule, a
+    // few parts per thread for dynamic and single elements at the end of a
+    // guided schedule (its chunks are proportional to what's left)
+    if (chunk <= 0)
+      switch (schedule) {
+        case Schedule::Static:  chunk = (n + nthreads - 1) / nthreads;  break;
+        case Schedule::Dynamic: chunk = max(1l, n / (8*nthreads));      break;
+        case Schedule::Guided:  chunk = 1;                              break;
+      }
+    chunk = max(1l, chunk);
+  }
+
+  bool Pool::Range::next(long &begin, long &end) {
+    begin = position.load(memory_order_relaxed);
+    do {
+      if (begin >= last)
+        return false;
+      end = min(last, begin + length(begin));
+    } while (!position.compare_exchange_weak(begin, end));
+    return true;
+  }
+
+  size_t Pool::Range::chunks() const {
+    if (schedule != Schedule::Guided)
+      return max(0l, last - position + chunk - 1) / chunk;
+    size_t n{0};
+    for (long begin = position; begin < last; begin += length(begin))
+      ++n;
+    return n;
+  }
+
+  long Pool::Range::length(long position) const {
+    // guided chunks get half of what would be a fair share of the rest
+    if (schedule == Schedule::Guided)
+      return max(chunk, (last - position) / (2*nthreads));
+    return chunk;
+  }
+
+  void Pool::attach(Observer const &hooks) {
+    unique_lock _{hook_lock};
+
+    // no thread calls the observer once this is seen, and the ones calling
+    // it already are flagged: wait until they are out
+    hooked = false;
+    auto calling = [this]() -> bool {
+      if (hooking)
+        return true;
+      for (auto &worker : workers)
+        if (worker->hooking)
+          return true;
+      return false;
+    };
+    while (calling())
+      this_thread::yield();
+
+    observer = hooks;
+    hooked   = hooks.object != nullptr;
+  }
+
+  void Pool::hook(void (*Observer::*which)(void *, size_t), size_t n) {
+    // flag the call before checking again, so that attach() either sees
+    // the flag or we see its change: workers have their own flag, in their
+    // cache line, other threads share one
+    auto &calling = current_pool == this ? workers[current_worker]->hooking
+                                         : hooking;
+    ++calling;
+    if (hooked)
+      (observer.*which)(observer.object, n);
+    calling.fetch_sub(1, memory_order_release);
+  }
+
+  bool Pool::pop(size_t self, Job &job, size_t &level) {
+    // order in which the levels are searched: highest first, except that
+    // every 4th turn normal tasks go first and every 16th turn background
+    // tasks do, so that no level starves while higher ones keep coming
+    static constexpr size_t orders[levels][levels] = {
+      {0, 1, 2}, {1, 0, 2}, {2, 0, 1},
+    };
+    size_t turn = ++workers[self]->turn;
+    auto  &order = orders[turn % 16 == 0 ? 2 : turn % 4 == 0 ? 1 : 0];
+
+    for (size_t l : order) {
+      if (!waiting[l])
+        continue;
+      level = l;
+
+      // the newest task of our own is the most likely to be cached
+      {
+        auto &worker = *workers[self];
+        auto _ = acquire(worker.lock, worker.counters.contended);
+        if (take(worker, level, true, job))
+          return true;
+      }
+
+      // otherwise steal the oldest task of the nearest workers, skipping
+      // those that are busy with their own queue at the moment
+      for (size_t victim : workers[self]->victims) {
+        auto &worker = *workers[victim];
+        unique_lock lock{worker.lock, try_to_lock};
+        if (!lock)
+          worker.counters.contended.fetch_add(1, memory_order_relaxed);
+        else if (take(worker, level, false, job)) {
+          add(workers[self]->counters.steals, 1);
+          return true;
+        }
+      }
+    }
+
+    // a second, patient round in case a queue was locked during the first
+    for (size_t l : order) {
+      level = l;
+      for (size_t victim : workers[self]->victims) {
+        if (!waiting[level])
+          break;
+        auto &worker = *workers[victim];
+        auto _ = acquire(worker.lock, worker.counters.contended);
+        if (take(worker, level, false, job)) {
+          add(workers[self]->counters.steals, 1);
+          return true;
+        }
+      }
+    }
+
+    return false;
+  }
+
+  bool Pool::take(Worker &worker, size_t level, bool owner, Job &job) {
+    // tasks from outside go in order, after the owner's own tasks for the
+    // owner and before them for anyone else, so they are never left behind
+    auto &tasks = worker.tasks[level];
+    auto &inbox = worker.inbox[level];
+    if (owner && !tasks.empty())
+      job = tasks.pop_back();
+    else if (!inbox.empty())
+      job = inbox.pop_front();
+    else if (!tasks.empty())
+      job = tasks.pop_front();
+    else
+      return false;
+    --waiting[level];
+    return true;
+  }
+
+  void Pool::run(size_t self) {
+    current_pool   = this;
+    current_worker = self;
+    // if pinning fails, the worker just runs wherever the scheduler wants
+    if (workers[self]->cpu >= 0)
+      pin(workers[self]->cpu);
+
+    auto &counters = workers[self]->counters;
+    size_t level;
+    Job job;
+    // it will run forever until explicitly asked to stop
+    while (!done) {
+      // look for work everywhere before considering going to sleep
+      if (!pending || !pop(self, job, level)) {
+        // new tasks may come right away, wait a little for them before
+        // going through the kernel
+        if (linger())
+          continue;
+
+        // with timers waiting, one idle worker keeps time instead
+        if (next_timer != numeric_limits<int64_t>::max() &&
+            !keeping.exchange(true)) {
+          keep();
+          continue;
+        }
+
+        bool measure = timing();
+        auto asleep = measure ? clock::now() : clock::time_point{};
+        bool expired{false};
+
+        // park on the atomic, its value changes whenever sleepers are woken
+        // up, so a wake up between load and wait is never missed
+        if (!elastic || live <= bounds.min) {
+          auto signal = wakeups.load();
+          ++parked;
+          if (!pending && !done)
+            wakeups.wait(signal);
+          --parked;
+        }
+
+        // a pool that may shrink checks once in a while who is idle
+        else {
+          auto lock = acquire(queue_lock, contended);
+          ++sleeping;
+          // wait for tasks to be added to queue or finish
+          auto ready = [this]() -> bool {
+            // move on if there are more tasks or if we are finished, or to
+            // keep time if nobody does
+            return pending || done ||
+              (next_timer != numeric_limits<int64_t>::max() && !keeping);
+          };
+          expired = !queued.wait_for(lock, bounds.idle, ready);
+          --sleeping;
+        }
+        if (measure)
+          add(counters.idle, nanoseconds(asleep, clock::now()));
+        if (expired && retire(self))
+          return;
+        continue;
+      }
+
+      perform(job, level, &counters);
+
+      // the timers may be due while the one keeping time is busy too
+      auto due = next_timer.load(memory_order_relaxed);
+      if (due != numeric_limits<int64_t>::max() &&
+          clock::now().time_since_epoch().count() >= due)
+        expire();
+    }
+  }
+
+  void Pool::arm(clock::time_point when, Task &&task) {
+    bool earlier{false};
+    {
+      unique_lock _{timer_lock};
+      if (!closed) {
+        timers.add(when, std::move(task));
+        auto next = timers.next().time_since_epoch().count();
+        earlier = next < next_timer;
+        next_timer = next;
+      }
+    }
+
+    // a pool shutting down doesn't take any more timers
+    if (task) {
+      bool outer = exchange(discarding, true);
+      task();
+      discarding = outer;
+      return;
+    }
+
+    // whoever keeps time must look at the new one, or someone must start
+    if (!earlier)
+      return;
+    if (keeping || sleeping) {
+      { auto _ = acquire(queue_lock, contended); }
+      queued.notify_all();
+    }
+    if (!keeping && parked) {
+      ++wakeups;
+      wakeups.notify_one();
+    }
+    if (!keeping && current_pool != this && !live)
+      spawn();
+  }
+
+  void Pool::expire() {
+    vector<Task> due;
+    {
+      unique_lock lock{timer_lock, try_to_lock};
+      if (!lock)
+        return;
+      timers.advance(clock::now(), due);
+      next_timer = timers.next().time_since_epoch().count();
+    }
+    if (due.empty())
+      return;
+
+    // all that is due is queued at once
+    vector<Job> jobs;
+    jobs.reserve(due.size());
+    for (auto &task : due)
+      jobs.push_back({std::move(task), 1});
+    enqueue(Priority::Normal, std::move(jobs));
+  }
+
+  void Pool::keep() {
+    // sleep until the next timer is due, unless tasks come, the pool is
+    // done or an earlier timer is armed meanwhile
+    {
+      auto lock = acquire(queue_lock, contended);
+      auto seen = next_timer.load();
+      if (seen != numeric_limits<int64_t>::max()) {
+        ++sleeping;
+        queued.wait_until(lock, clock::time_point{clock::duration{seen}},
+                          [this, seen]() -> bool {
+                            return pending || done || next_timer != seen;
+                          });
+        --sleeping;
+      }
+    }
+    expire();
+    keeping = false;
+
+    // off to run tasks, someone else should keep time meanwhile
+    if (pending && next_timer != numeric_limits<int64_t>::max() && parked) {
+      ++wakeups;
+      wakeups.notify_one();
+    }
+  }
+
+  void Pool::disarm() {
+    vector<Task> tasks;
+    {
+      unique_lock _{timer_lock};
+      timers.clear(tasks);
+      next_timer = numeric_limits<int64_t>::max();
+    }
+    bool outer = exchange(discarding, true);
+    for (auto &task : tasks)
+      task();
+    discarding = outer;
+  }
+
+  bool Pool::linger() {
+    size_t spins  = idling.spins.load(memory_order_relaxed);
+    size_t yields = idling.yields.load(memory_order_relaxed);
+    for (size_t i{0}; i < spins; ++i) {
+      if (pending || done)
+        return true;
+      relax();
+    }
+    for (size_t i{0}; i < yields; ++i) {
+      if (pending || done)
+        return true;
+      this_thread::yield();
+    }
+    return false;
+  }
+
+  void Pool::perform(Job &job, size_t level, Counters *counters) {
+    // mark as working before the task is accounted as dequeued, so that
+    // wait() never sees both counters at zero while we hold a task
+    ++processing;
+    --pending;
+    if (blocked)
+      pending.notify_all();
+    size_t outer = exchange(current_level, level);
+    Pool  *pool  = exchange(performing, this);
+    ++task_depth;
+
+    // tasks waiting in queue for too long ask for one more thread, and
+    // the time of the last dequeue is only updated once in a while so
+    // that workers don't all write to it all the time
+    if (elastic) {
+      auto now = clock::now();
+      if (since(now, dequeued_at.load(memory_order_relaxed)) >
+          bounds.wait / 4)
+        dequeued_at.store(ticks(now), memory_order_relaxed);
+      if (live < bounds.max && pending && now - job.queued > bounds.wait)
+        spawn();
+    }
+
+    // tasks run by outsiders are accounted in counters shared by all of
+    // them, where every thread adds atomically
+    auto &into  = counters ? *counters : outsiders;
+    auto  count = [counters](atomic<uint64_t> &counter, uint64_t n) {
+      if (counters)
+        add(counter, n);
+      else
+        counter.fetch_add(n, memory_order_relaxed);
+    };
+
+    // execute task and release whatever it holds right away, timing it
+    // (and its stay in the queue) only if it was timestamped when queued
+    if (timing() && job.queued != clock::time_point{}) {
+      auto start = clock::now();
+      job.task();
+      job.task.reset();
+      auto ran    = nanoseconds(start, clock::now());
+      auto waited = nanoseconds(job.queued, start);
+      count(into.wait[Histogram::bucket(waited)], 1);
+      count(into.run[Histogram::bucket(ran)], 1);
+      count(into.busy, ran);
+    }
+    else {
+      job.task();
+      job.task.reset();
+    }
+    job.queued = {};
+    count(into.tasks, 1);
+    current_level = outer;
+    performing    = pool;
+    --task_depth;
+
+    // account for the finished task(s) in the dequeue hook
+    if (job.weight)
+      dequeue_hook(job.weight);
+
+    // notify that the pool may have become idle, except for the workers
+    // that are themselves waiting for it from inside a task
+    if (--processing <= nested && !pending) {
+      { auto _ = acquire(queue_lock, contended); }
+      dequeued.notify_all();
+    }
   }
 
 }
@@ -1,141 +1,525 @@
 #include "ThreadPool_Bars.hpp"
 #include "ThreadPool.hpp"
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <csignal>
+#include <cstdio>
 #include <functional>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <numeric>
+#include <sys/ioctl.h>
+#include <unistd.h>
 
 namespace ThreadPool {
 
   using namespace std;
   using namespace Progress;
-  thread::id const id0{};     // default unjoinable value used for total bar
 
-  Bars::Bars(Pool &pool)
+  Bars::Bars(Pool &pool, Refresh refresh)
+      : Bars{pool, nullptr, refresh} {}
+
+  Bars::Bars(Pool &pool, shared_ptr<Sink> sink, Refresh refresh)
       : pool{pool}
+      , refresh{refresh}
+      , sink{move(sink)}
+      , reached{0}
+      , rate{0}
+      , nslots{pool.size() + 1}
+      , slots{make_unique<Slot[]>(nslots)}
+      , updated{false}
       , tracking{false} {
 
-    // add hook to thread pool when enqueuing a new task
-    pool.set_enqueue([this](){
-      auto &bar = get_bar(id0);
-      unique_lock lock{mutex};
+    // decide what kind of output we have, without output there's no need
+    // to track anything at all: counters keep working, but nobody watches
+    if (this->sink)
+      this->refresh.mode = Refresh::Report;
+    else if (refresh.mode == Refresh::Report)
+      this->refresh.mode = Refresh::Off;
+    else if (refresh.mode == Refresh::Auto)
+      this->refresh.mode = isatty(STDOUT_FILENO) ? Refresh::Terminal
+                                                 : Refresh::Plain;
+    if (this->refresh.mode == Refresh::Off)
+      return;
 
-      // already tracking, just increment our task counter total number
-      if (tracking) {
-        lock.unlock();
-        get<0>(bar).add_step();
-      }
-      // first task: counter is default initialized to 1 and we start tracker
-      else {
-        tracking = true;
-        lock.unlock();
-        start();
-      }
-    });
+    // follow the tasks of the pool: see enqueued() and dequeued()
+    pool.observe(this);
+  }
 
-    // add hook to the thread pool when dequeuing (after executing) a task
-    pool.set_dequeue([this](){
-      // we just need to mark a task as done by increment task counter
+  Bars::~Bars() {
+    // first stop observing the thread pool, so that no hook is left running
+    // (which could be restarting the tracker)
+    if (refresh.mode != Refresh::Off)
+      pool.observe();
+    // then immediately shut down everything
+    {
       unique_lock _{mutex};
-      tracking = ++get<0>(get_bar(id0));
-    });
+      tracking = false;
+    }
+    changed.notify_one();
+    unique_lock _{restart};
+    if (tracker.joinable())
+      tracker.join();
   }
 
-  Bars::~Bars() {
-    // destructor will immediately shut down everything
-    tracking = false;
+  void Bars::enqueued(size_t n) {
+    // already tracking, just increment our task counter total number
+    if (tracking) {
+      total.counter.add_step(n);
+      return;
+    }
+
+    // first task: the tracker of a previous round may still be drawing
+    // its last frame (and then clearing the counters), so it must be
+    // gone before we start again, and only one thread may restart it
+    unique_lock _{restart};
     if (tracker.joinable())
       tracker.join();
-    // and don't forget to remove the hooks from the thread pool
-    pool.set_enqueue();
-    pool.set_dequeue();
+    unique_lock lock{mutex};
+    if (tracking) {
+      lock.unlock();
+      total.counter.add_step(n);
+    }
+    // counter is default initialized to 1 and we start the tracker
+    else {
+      tracking = true;
+      lock.unlock();
+      if (n > 1)
+        total.counter.add_step(n - 1);
+      start();
+    }
+  }
+
+  void Bars::dequeued(size_t n) {
+    // a task that ran inside another one (or on a thread outside the pool)
+    // may have taken the bar of the one it interrupted, which gets it back
+    if (size_t depth = Pool::depth(); depth || pool.thread_index() < 0) {
+      auto &slot = get_slot();
+      if (slot.depth.load(memory_order_relaxed) > depth)
+        resume(slot, depth);
+    }
+
+    // we just need to mark tasks as done by increment task counter, the
+    // lock is only needed to wake up the tracker: for the first change
+    // since it last looked, and for the last task (a change missed while
+    // it looks is seen at its next refresh anyway)
+    total.counter.advance(n);
+    if (updated.load(memory_order_relaxed) && total.counter)
+      return;
+    unique_lock _{mutex};
+    tracking = total.counter;
+    if (!updated || !tracking) {
+      updated = true;
+      changed.notify_one();
+    }
   }
 
   Counter& Bars::new_counter(int n, string_view message) {
-    // get a (maybe new) bar associated with this thread
-    auto &bar = get_bar(this_thread::get_id());
-    // reset the counter and message to the requested values
-    bar = {Counter{n}, string{message}};
+    // get the bar associated with this thread, and the counter of the task
+    // it is running (workers have their slot to themselves, other threads
+    // share theirs)
+    auto  &slot  = get_slot();
+    long   index = pool.thread_index();
+    size_t depth = Pool::depth();
+    Meter *meter;
+    {
+      unique_lock _{slot.lock};
+      meter = &slot.meters[{
+        index < 0 ? this_thread::get_id() : thread::id{}, depth
+      }];
+      meter->message = message;
+      slot.message   = message;
+    }
+    // reset the counter to the requested value and show it
+    meter->counter.reset(n);
+    slot.current.store(&meter->counter, memory_order_release);
+    slot.depth.store(depth, memory_order_relaxed);
+    slot.started.fetch_add(1, memory_order_relaxed);
+    if (index >= 0)
+      slot.generation = pool.generation(index);
+    slot.used = true;
     // return the counter
-    return get<0>(bar);
+    return meter->counter;
+  }
+
+  void Bars::resume(Slot &slot, size_t depth) {
+    // the meter of the deepest task of this thread up to the given depth
+    auto id = pool.thread_index() < 0 ? this_thread::get_id() : thread::id{};
+    unique_lock _{slot.lock};
+    auto meter = slot.meters.upper_bound({id, depth});
+    if (meter == slot.meters.begin() || prev(meter)->first.first != id)
+      return;
+    --meter;
+    slot.message = meter->second.message;
+    slot.current.store(&meter->second.counter, memory_order_release);
+    slot.depth.store(meter->first.second, memory_order_relaxed);
   }
 
   void Bars::set_message(std::string_view message) {
-    // set message of the total bar (thread id0)
-    get<1>(get_bar(id0)) = message;
+    // set message of the total bar
+    unique_lock _{total.lock};
+    total.message = message;
+  }
+
+  void Bars::track(TaskGroup const &group) {
+    unique_lock _{grouping};
+    groups.push_back(group.tally);
+  }
+
+  void Bars::track(Pipeline const &pipeline) {
+    unique_lock _{grouping};
+    for (auto &stage : pipeline.stages)
+      stages.push_back(stage.tally);
   }
 
   void Bars::wait() {
     // wait for pool to reach idle state (i.e. all tasks finished)
     pool.wait();
     // then wait for last update of the bars to the screen
+    unique_lock _{restart};
     if (tracker.joinable())
       tracker.join();
     // output state should be clean now and we can use Bars object again
   }
 
-  Bars::Thread_Bar& Bars::get_bar(Thread_ID id) {
-    try {
-      // get bar associated with this thread, throw if nonexistent
-      return bars.at(id);
+  Bars::Slot& Bars::get_slot() {
+    // workers have their own slot, the last one is shared by everyone else
+    long index = pool.thread_index();
+    return slots[index < 0 ? nslots - 1 : index];
+  }
+
+  bool Bars::visible(size_t i) const {
+    // bars of workers that retired, or whose thread was replaced by a new
+    // one that has no counter yet, are gone
+    if (!slots[i].used)
+      return false;
+    return i == nslots - 1 ||
+      (i < pool.active() && slots[i].generation == pool.generation(i));
+  }
+
+  bool Bars::print(bool force) {
+    // refresh the copy of a message, unless its owner is writing it now
+    bool renamed{false};
+    auto message = [&renamed](Slot &slot) -> string const& {
+      unique_lock lock{slot.lock, try_to_lock};
+      if (lock && slot.shown != slot.message) {
+        slot.shown = slot.message;
+        renamed = true;
+      }
+      return slot.shown;
+    };
+
+    vector<size_t> shown;
+    auto fractions = measure(shown);
+
+    // stages of a pipeline take the place of the threads, which all run
+    // the same stages anyway
+    auto groups = tallies(this->groups);
+    auto stages = tallies(this->stages);
+    if (!stages.empty()) {
+      fractions.resize(1);
+      shown.clear();
     }
-    catch (out_of_range const &e) {
-      // to create a new bar we need to protect our object
-      unique_lock _{mutex};
-      return bars[id];
+
+    // when the bars of the workers don't fit, only a summary of them is
+    // drawn and the slowest ones, whatever the number of threads
+    bool compact = shown.size() > refresh.compact ||
+      1 + groups.size() + stages.size() + shown.size() >= rows();
+    vector<double> summary;
+    if (compact)
+      summary = summarize(fractions, shown);
+
+    // groups and stages (then the summary) come after the threads when
+    // comparing, but are drawn first
+    for (auto &tracked : {&groups, &stages})
+      for (auto &tally : *tracked) {
+        long tasks = tally->counter.get_total();
+        fractions.push_back(tasks ? tally->counter.get_count() / double(tasks)
+                                  : 1.0);
+      }
+    fractions.insert(fractions.end(), summary.begin(), summary.end());
+
+    // skip drawing unless something changed enough to be visible
+    bool moved = fractions.size() != drawn.size();
+    for (size_t i{0}; !moved && i < fractions.size(); ++i)
+      moved = abs(fractions[i] - drawn[i]) >= refresh.delta;
+    message(total);
+    for (size_t i : shown)
+      message(slots[i]);
+    if (!moved && !renamed && !force)
+      return false;
+    drawn = move(fractions);
+
+    // total bar first, then groups and stages, the other bars are
+    // straightforward
+    auto bar = drawn.begin();
+    auto &line = screen.line();
+    Bar(line, *bar++);
+    line += total.shown;
+    auto tally = drawn.begin() + 1 + shown.size();
+    for (auto &tracked : {&groups, &stages})
+      for (auto &group : *tracked) {
+        auto &line = screen.line();
+        Bar(line, *tally++);
+        line += group->name;
+      }
+    if (!compact)
+      for (size_t i : shown) {
+        auto &line = screen.line();
+        Bar(line, *bar++);
+        line += slots[i].shown;
+      }
+
+    // summary of the workers: one character per bucket of the histogram,
+    // as high as its share of workers, then a bar per slowest worker with
+    // its index (and how long it has been stalled)
+    else {
+      static string const spark[] {" ", "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
+      char text[64];
+      auto &line = screen.line();
+      double most = *max_element(summary.begin(), summary.begin() + buckets);
+      snprintf(text, sizeof(text), "%6zu workers   0%% ▕",
+               size_t(summary[buckets]));
+      line += text;
+      for (size_t b{0}; b < buckets; ++b)
+        line += spark[most ? size_t(ceil(8 * summary[b] / most)) : 0];
+      snprintf(text, sizeof(text), "▏100%%   %zu stalled",
+               size_t(summary[buckets + 1]));
+      line += text;
+      line += "\33[K";
+      for (size_t k{0}; k < shown.size(); ++k) {
+        auto &line = screen.line();
+        Bar(line, *bar++);
+        snprintf(text, sizeof(text), "#%zu ", shown[k]);
+        line += shown[k] == nslots - 1 ? "#- " : text;
+        line += slots[shown[k]].shown;
+        if (size_t stalled = summary[buckets + 3 + 2*k]) {
+          snprintf(text, sizeof(text), " (stalled %zus)", stalled);
+          line += text;
+        }
+      }
+    }
+
+    // the screen overwrites the bars in place, sending only what changed
+    screen.draw();
+    return true;
+  }
+
+  bool Bars::print_plain(bool force) {
+    // only the total progress, in whole percents, as a line of text
+    double fraction = total.counter;
+    if (!force && !drawn.empty() && abs(fraction - drawn[0]) < 0.01)
+      return false;
+    drawn = {fraction};
+
+    unique_lock _{total.lock};
+    cout << setw(5) << int(fraction * 100 + 0.5) << "% " << total.message
+         << endl;
+    return true;
+  }
+
+  bool Bars::report(bool finished) {
+    Snapshot snapshot;
+    vector<size_t> shown;
+    auto fractions = measure(shown);
+    auto now = clock::now();
+
+    snapshot.elapsed  = chrono::duration<double>(now - began).count();
+    snapshot.done     = total.counter.get_count();
+    snapshot.tasks    = total.counter.get_total();
+    snapshot.fraction = min(1.0, fractions[0]);
+    auto stages = tallies(this->stages);
+    if (!stages.empty())
+      shown.clear();
+    for (size_t i{0}; i < shown.size(); ++i)
+      snapshot.bars.push_back({
+        shown[i] == nslots - 1 ? -1 : long(shown[i]), fractions[i + 1]
+      });
+    for (auto &group : tallies(groups))
+      snapshot.groups.push_back({
+        group->name, group->counter.get_count(), group->counter.get_total()
+      });
+    for (auto &group : stages)
+      snapshot.groups.push_back({
+        group->name, group->counter.get_count(), group->counter.get_total()
+      });
+    {
+      unique_lock _{total.lock};
+      snapshot.message = total.message;
+    }
+    snapshot.finished = finished;
+
+    // the rate is an exponential moving average that forgets what happened
+    // more than a few seconds ago, counting partial tasks so that long
+    // tasks reporting their progress don't make it stall
+    double progress = snapshot.fraction * snapshot.tasks;
+    double seconds  = chrono::duration<double>(now - reported).count();
+    if (seconds > 0) {
+      double current = max(0.0, progress - reached) / seconds;
+      double weight  = reached ? 1 - exp(-seconds / 5) : 1;
+      rate += weight * (current - rate);
     }
+    reached  = progress;
+    reported = now;
+    snapshot.rate = rate;
+    snapshot.eta  = rate > 0 ? (snapshot.tasks - progress) / rate : -1;
+
+    sink->report(snapshot);
+    return true;
   }
 
-  void Bars::print() {
+  vector<double> Bars::measure(vector<size_t> &shown) const {
     // first bar (total) needs to account for partial values of others
-    auto const &[counter, message] = bars[id0];
-    double total = counter;
-    double step  = counter.get_step();
-    for (auto const &[id, bar] : bars) {
-      if (id == id0) continue;
-      double partial = get<0>(bar);
+    vector<double> fractions{total.counter};
+    double step = total.counter.get_step();
+    for (size_t i{0}; i < nslots; ++i) {
+      if (!visible(i)) continue;
+      double partial = *slots[i].current.load(memory_order_acquire);
+      fractions.push_back(partial);
+      shown.push_back(i);
       // if partial >= 1 it's not partial, therefore already accounted for
       if (partial < 1)
-        total += step * partial;
+        fractions[0] += step * partial;
     }
-    Bar(total) << message << endl;
+    return fractions;
+  }
+
+  vector<double> Bars::summarize(vector<double> &fractions,
+                                 vector<size_t> &shown) {
+    auto now   = clock::now();
+    auto stall = chrono::duration<double>(refresh.stalled);
 
-    // the other bars are straightforward
-    for (auto const &[id, bar] : bars) {
-      if (id == id0) continue;
-      auto const &[counter, message] = bar;
-      Bar(counter) << message << endl;
+    // a counter stalls when it neither moves nor is replaced by a new one
+    // for a while before reaching its end
+    vector<double> summary(buckets + 2, 0);
+    vector<double> stalled(shown.size(), 0);
+    for (size_t k{0}; k < shown.size(); ++k) {
+      auto &slot = slots[shown[k]];
+      double fraction = fractions[k + 1];
+      long   count    = slot.current.load(memory_order_acquire)->get_count();
+      size_t started  = slot.started;
+      if (count != slot.seen || started != slot.known) {
+        slot.seen  = count;
+        slot.known = started;
+        slot.since = now;
+      }
+      if (fraction < 1 && now - slot.since >= stall) {
+        stalled[k] = chrono::duration<double>(now - slot.since).count();
+        summary[buckets + 1] += 1;
+      }
+      summary[min(size_t(max(0.0, fraction) * buckets), buckets - 1)] += 1;
     }
+    summary[buckets] = shown.size();
+
+    // the slowest are the ones stalled for longest, then the ones with
+    // least progress, only those are kept
+    vector<size_t> order(shown.size());
+    iota(order.begin(), order.end(), 0);
+    auto slowest = order.begin() + min(refresh.slowest, order.size());
+    partial_sort(order.begin(), slowest, order.end(),
+                 [&](size_t a, size_t b) -> bool {
+                   if (stalled[a] != stalled[b])
+                     return stalled[a] > stalled[b];
+                   return fractions[a + 1] < fractions[b + 1];
+                 });
+    order.erase(slowest, order.end());
+
+    vector<size_t> kept;
+    vector<double> partial{fractions[0]};
+    for (size_t k : order) {
+      kept.push_back(shown[k]);
+      partial.push_back(fractions[k + 1]);
+      summary.push_back(shown[k]);
+      summary.push_back(stalled[k] ? max(1.0, floor(stalled[k])) : 0);
+    }
+    shown     = move(kept);
+    fractions = move(partial);
+    return summary;
+  }
 
-    // now here's the trick to move the cursor up to the first bar's line
-    // so next iteration when we print, we will overwrite the bars in place
-    cout << "\33[" << bars.size() << 'F';
+  size_t Bars::rows() const {
+    winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) < 0 || !size.ws_row)
+      return numeric_limits<size_t>::max();
+    return size.ws_row;
+  }
+
+  vector<shared_ptr<Tally>> Bars::tallies(vector<weak_ptr<Tally>> &tracked) {
+    unique_lock _{grouping};
+    vector<shared_ptr<Tally>> alive;
+    erase_if(tracked, [&alive](auto &group) {
+      if (auto tally = group.lock()) {
+        alive.push_back(move(tally));
+        return false;
+      }
+      return true;
+    });
+    return alive;
   }
 
   void Bars::start() {
     // set up the tracker thread with this lambda
     tracker = thread{[this](){
-      using namespace chrono_literals;
+      using namespace chrono;
+      using clock = steady_clock;
+
+      // in plain mode we just print the total once in a while, and reports
+      // go to the sink at their own steady rate
+      bool plain    = refresh.mode == Refresh::Plain;
+      bool terminal = refresh.mode == Refresh::Terminal;
+      auto period = duration_cast<clock::duration>(duration<double>{
+        1 / (plain ? refresh.plain : terminal ? refresh.rate
+                                              : refresh.report)});
+      began   = reported = clock::now();
+      reached = rate = 0;
 
       // first, hide cursor for a cleaner output
-      cout << "\033[?25l";
+      if (terminal)
+        screen.raw("\033[?25l");
 
-      // enter loop that updates the screen every iteration until finished
-      do {
-        this_thread::sleep_for(16ms /* equiv. approx 60Hz */);
-        print();
-      } while (tracking);
+      // enter loop that updates the screen until finished: wait for a task
+      // to finish or for some time (longer while nothing changes), but
+      // never redraw faster than the maximum rate
+      clock::duration const idle_max = 500ms;
+      auto idle = period;
+      auto last = clock::now();
+      for (bool finished{false}; !finished;) {
+        {
+          unique_lock lock{mutex};
+          changed.wait_until(lock, last + period, [this]() {
+            return !tracking;
+          });
+          changed.wait_for(lock, idle - period, [this]() {
+            return updated || !tracking;
+          });
+          updated  = false;
+          finished = !tracking;
+        }
+        last = clock::now();
 
-      // after finishing, move the cursor to the line after all bars
-      for (int i = bars.size(); i > 0; --i)
-        cout << endl;
+        bool drew = plain    ? print_plain(finished)
+                  : terminal ? print(finished)
+                             : report(finished);
+        idle = drew ? period
+                    : min<clock::duration>(2*idle, max(period, idle_max));
+      }
 
-      // and clear all the counters
-      bars.clear();
+      // after finishing, restore cursor visibility and move the cursor to
+      // the line after all bars
+      if (terminal) {
+        screen.raw("\033[?12l\033[?25h");
+        screen.close();
+      }
 
-      // finally, restore cursor visibility
-      cout << "\033[?12l\033[?25h" << flush;
+      // and clear all the counters
+      drawn.clear();
+      for (size_t i{0}; i < nslots; ++i)
+        slots[i].used = false;
+      total.counter.reset();
+      set_message("");
     }};
   }
 
@@ -0,0 +1,103 @@
+#include "ThreadPool_Graph.hpp"
+#include "ThreadPool.hpp"
+
+#include <chrono>
+
+namespace ThreadPool {
+
+  using namespace std;
+
+  Graph::Graph(Pool &pool, Priority priority)
+      : pool{pool}, priority{priority}, remaining{0}, failed{false}
+      , running{false}, finished{true} {}
+
+  Graph::~Graph() {
+    // tasks still queued refer to this graph, let them finish
+    try {
+      wait();
+    }
+    catch (...) {
+      // the exception was never asked for
+    }
+  }
+
+  Graph::Node Graph::insert(Task &&task, initializer_list<Node> after) {
+    size_t index = vertices.size();
+    vertices.emplace_back(std::move(task), after.size());
+    for (auto node : after)
+      vertices[node.index].successors.push_back(index);
+    return {this, index};
+  }
+
+  void Graph::run() {
+    if (vertices.empty())
+      return;
+
+    // everything is reset before the first task can possibly finish
+    for (auto &vertex : vertices)
+      vertex.waiting = vertex.predecessors;
+    remaining = vertices.size();
+    failed    = false;
+    error     = nullptr;
+    running   = true;
+    finished  = false;
+
+    for (size_t i{0}; i < vertices.size(); ++i)
+      if (!vertices[i].predecessors)
+        schedule(i);
+  }
+
+  void Graph::wait() {
+    if (!running)
+      return;
+
+    // run tasks of the pool meanwhile, as any waiting thread does
+    unique_lock lock{this->lock};
+    auto finished = [this]() -> bool {return this->finished;};
+    pool.wait_until(lock, finished, [&](chrono::microseconds pause) {
+      done.wait_for(lock, pause, finished);
+    });
+    running = false;
+    if (error)
+      rethrow_exception(error);
+  }
+
+  void Graph::schedule(size_t index) {
+    // queued as a bare task: when the pool drops it, execute() still runs
+    // to fail the graph, otherwise it would never finish
+    pool.enqueue(priority, [this, index]() {execute(index);});
+  }
+
+  void Graph::execute(size_t index) {
+    auto &vertex = vertices[index];
+
+    // after the first error the remaining tasks are just skipped, and a
+    // task dropped by the pool fails the graph as if it threw Cancelled
+    if (!failed) {
+      try {
+        if (Pool::discarding)
+          throw Cancelled{};
+        vertex.task();
+      }
+      catch (...) {
+        unique_lock _{lock};
+        if (!failed.exchange(true))
+          error = current_exception();
+      }
+    }
+
+    // the last predecessor to finish is the one that queues a task
+    for (size_t next : vertex.successors)
+      if (!--vertices[next].waiting)
+        schedule(next);
+
+    // the graph may be gone as soon as the waiter sees it finished, so it's
+    // signalled under the lock and nothing is touched after that
+    if (!--remaining) {
+      unique_lock _{lock};
+      finished = true;
+      done.notify_all();
+    }
+  }
+
+}
@@ -0,0 +1,70 @@
+#include "ThreadPool_Group.hpp"
+#include "ThreadPool.hpp"
+
+#include <chrono>
+
+namespace ThreadPool {
+
+  using namespace std;
+
+  TaskGroup::TaskGroup(Pool &pool, string_view name)
+      : pool{pool}, parent{nullptr}
+      , tally{make_shared<Tally>(string{name}, 0)}, running{0} {}
+
+  TaskGroup::TaskGroup(TaskGroup &parent, string_view name)
+      : pool{parent.pool}, parent{&parent}
+      , tally{make_shared<Tally>(string{name}, 0)}, running{0} {}
+
+  TaskGroup::~TaskGroup() {
+    // queued tasks refer to this group, let them finish
+    wait();
+  }
+
+  void TaskGroup::wait() {
+    // a worker must not block, it runs tasks of the pool meanwhile (and so
+    // does any other waiting thread, as in Pool::wait())
+    unique_lock lock{this->lock};
+    auto finished = [this]() -> bool {return !running;};
+    pool.wait_until(lock, finished, [&](chrono::microseconds pause) {
+      done.wait_for(lock, pause, finished);
+    });
+  }
+
+  void TaskGroup::start(size_t n) {
+    for (auto group = this; group; group = group->parent) {
+      group->running += n;
+      group->tally->counter.add_step(n);
+    }
+  }
+
+  void TaskGroup::finish() {
+    for (auto group = this; group;) {
+      // the group may be gone as soon as the waiter sees it finished, so
+      // only the last task takes the lock to signal it, and nothing is
+      // touched after that
+      auto outer = group->parent;
+      group->tally->counter.advance();
+      size_t n = group->running;
+      while (n > 1 && !group->running.compare_exchange_weak(n, n - 1));
+      if (n <= 1) {
+        unique_lock _{group->lock};
+        if (!--group->running)
+          group->done.notify_all();
+      }
+      group = outer;
+    }
+  }
+
+  void TaskGroup::submit(Priority priority, Task &&task) {
+    start(1);
+    try {
+      pool.enqueue(priority, std::move(task));
+    }
+    catch (...) {
+      // refused by a full pool (Overflow::Fail)
+      finish();
+      throw;
+    }
+  }
+
+}
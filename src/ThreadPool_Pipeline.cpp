@@ -0,0 +1,163 @@
+#include "ThreadPool_Pipeline.hpp"
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include "Cancel.hpp"
+
+namespace ThreadPool {
+
+  using namespace std;
+
+  Pipeline::Pipeline(Pool &pool, size_t capacity)
+      : pool{pool}, capacity{capacity ? capacity : 2*pool.size()}
+      , produced{0}, completed{0}, exhausted{false}, failed{false}
+      , tasks{pool} {}
+
+  void Pipeline::run() {
+    if (stages.empty())
+      return;
+
+    // start over, the source is the only one with something to do
+    vector<Item>   items;
+    vector<size_t> which;
+    {
+      unique_lock _{lock};
+      produced  = completed = 0;
+      exhausted = failed    = false;
+      error     = nullptr;
+      for (auto &stage : stages) {
+        stage.queue.clear();
+        stage.running = stage.next = 0;
+        stage.tally->counter.reset(0);
+      }
+      pump(items, which);
+    }
+    launch(items, which);
+    tasks.wait();
+
+    // items missing without an exception were dropped by the pool
+    if (error)
+      rethrow_exception(error);
+    if (!exhausted || completed != produced)
+      throw Cancelled{};
+  }
+
+  Pipeline& Pipeline::add(string_view name,
+                          function<any(any &)> &&function,
+                          size_t parallelism, Order order, bool yields) {
+    // the next stage would get nothing to work on
+    if (!stages.empty() && !stages.back().yields)
+      throw invalid_argument{"pipeline stage after one returning void"};
+    stages.push_back({
+      std::move(function),
+      parallelism ? parallelism : numeric_limits<size_t>::max(),
+      order == Source, yields, {}, 0, 0, make_shared<Tally>(string{name}, 0)
+    });
+    return *this;
+  }
+
+  void Pipeline::pump(vector<Item> &items, vector<size_t> &which) {
+    if (failed)
+      return;
+
+    // later stages first: finishing items makes room for new ones
+    for (size_t i{stages.size()}; i-- > 1;) {
+      auto &stage = stages[i];
+      while (!stage.queue.empty() && stage.running < stage.limit &&
+             (!stage.ordered || stage.queue.front().index == stage.next)) {
+        items.push_back(std::move(stage.queue.front()));
+        which.push_back(i);
+        stage.queue.pop_front();
+        ++stage.running;
+        stage.next += stage.ordered;
+      }
+    }
+
+    // the source only produces while there is room for one more item, which
+    // bounds every queue in between (it's called by one task at a time)
+    auto &source = stages.front();
+    if (!exhausted && !source.running && produced - completed < capacity) {
+      items.push_back({produced, {}});
+      which.push_back(0);
+      ++source.running;
+    }
+  }
+
+  void Pipeline::launch(vector<Item> &items, vector<size_t> &which) {
+    for (size_t k{0}; k < items.size(); ++k) {
+      try {
+        tasks.post([this, i = which[k], item = std::move(items[k])]() mutable {
+          work(i, item);
+        });
+      }
+      catch (...) {
+        // refused by a full pool (Overflow::Fail), the run stops here
+        unique_lock _{lock};
+        if (!failed) {
+          failed = true;
+          error  = current_exception();
+        }
+        return;
+      }
+    }
+  }
+
+  void Pipeline::work(size_t i, Item &item) {
+    auto &stage = stages[i];
+    any value;
+    exception_ptr thrown;
+    try {
+      value = stage.function(item.value);
+    }
+    catch (...) {
+      thrown = current_exception();
+    }
+
+    vector<Item>   items;
+    vector<size_t> which;
+    {
+      unique_lock _{lock};
+      --stage.running;
+      if (thrown) {
+        // the first exception stops new items, the others finish
+        if (!failed) {
+          failed = true;
+          error  = thrown;
+        }
+        return;
+      }
+      if (i == 0) {
+        if (!value.has_value()) {
+          exhausted = true;
+          return;
+        }
+        // a new item adds a step to the bar of every stage
+        ++produced;
+        for (auto &stage : stages)
+          stage.tally->counter.add_step();
+      }
+      stage.tally->counter.advance();
+
+      // pass the item on, sorted when the next stage wants it in order
+      if (i + 1 == stages.size())
+        ++completed;
+      else {
+        auto &next = stages[i + 1];
+        Item passed{item.index, std::move(value)};
+        if (next.ordered)
+          next.queue.insert(upper_bound(
+            next.queue.begin(), next.queue.end(), item.index,
+            [](size_t index, Item const &other) -> bool {
+              return index < other.index;
+            }), std::move(passed));
+        else
+          next.queue.push_back(std::move(passed));
+      }
+      pump(items, which);
+    }
+    launch(items, which);
+  }
+
+}
@@ -0,0 +1,100 @@
+#include "ThreadPool_Sink.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <unistd.h>
+
+namespace ThreadPool {
+
+  using namespace std;
+
+  // append a number, with up to 6 significant digits
+  static void number(string &line, double value) {
+    char buffer[32];
+    int n = snprintf(buffer, sizeof(buffer), "%.6g", value);
+    line.append(buffer, n);
+  }
+
+  // append a string as a JSON string, quoted and escaped
+  static void quote(string &line, string_view text) {
+    line += '"';
+    for (char c : text)
+      if (c == '"' || c == '\\') {
+        line += '\\';
+        line += c;
+      }
+      else if ((unsigned char)c < 0x20) {
+        char buffer[8];
+        snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+        line += buffer;
+      }
+      else
+        line += c;
+    line += '"';
+  }
+
+  JsonLines::JsonLines(int fd)
+      : output{[fd](string_view line) {
+          // write everything, even if it takes more than one call
+          while (!line.empty()) {
+            auto n = ::write(fd, line.data(), line.size());
+            if (n < 0 && errno == EINTR)
+              continue;
+            if (n <= 0)
+              return;
+            line.remove_prefix(n);
+          }
+        }} {}
+
+  JsonLines::JsonLines(function<void(string_view)> output)
+      : output{move(output)} {}
+
+  void JsonLines::report(Snapshot const &snapshot) {
+    line  = "{\"elapsed\":";
+    number(line, snapshot.elapsed);
+    line += ",\"done\":";
+    line += to_string(snapshot.done);
+    line += ",\"tasks\":";
+    line += to_string(snapshot.tasks);
+    line += ",\"fraction\":";
+    number(line, snapshot.fraction);
+    line += ",\"rate\":";
+    number(line, snapshot.rate);
+    line += ",\"eta\":";
+    if (snapshot.eta < 0)
+      line += "null";
+    else
+      number(line, snapshot.eta);
+
+    line += ",\"bars\":[";
+    for (auto &bar : snapshot.bars) {
+      if (&bar != &snapshot.bars.front())
+        line += ',';
+      line += "{\"worker\":";
+      line += to_string(bar.worker);
+      line += ",\"fraction\":";
+      number(line, bar.fraction);
+      line += '}';
+    }
+    line += "],\"groups\":[";
+    for (auto &group : snapshot.groups) {
+      if (&group != &snapshot.groups.front())
+        line += ',';
+      line += "{\"name\":";
+      quote(line, group.name);
+      line += ",\"done\":";
+      line += to_string(group.done);
+      line += ",\"tasks\":";
+      line += to_string(group.tasks);
+      line += '}';
+    }
+    line += "],\"message\":";
+    quote(line, snapshot.message);
+    line += ",\"finished\":";
+    line += snapshot.finished ? "true" : "false";
+    line += "}\n";
+
+    output(line);
+  }
+
+}
@@ -0,0 +1,103 @@
+#include "TimerWheel.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace ThreadPool {
+
+  TimerWheel::TimerWheel(clock::duration tick)
+      : start{clock::now()}, tick{max(tick, clock::duration{1})}
+      , current{0}, count{0} {}
+
+  void TimerWheel::add(clock::time_point when, Task &&task) {
+    // an empty wheel may have been left behind for long, it just jumps to
+    // the present instead of going through all the ticks in between
+    if (!count)
+      current = max(current, ticks(clock::now()));
+    // due at the first tick not before the given time
+    uint64_t due = ticks(when - clock::duration{1}) + 1;
+    place({max(due, current + 1), std::move(task)});
+    ++count;
+  }
+
+  void TimerWheel::advance(clock::time_point now, vector<Task> &expired) {
+    for (uint64_t last = ticks(now); current < last && count;) {
+      ++current;
+
+      // every full revolution of a level moves the next slot of the level
+      // above down, highest level first
+      for (size_t level{levels - 1}; level > 0; --level) {
+        if (current & ((uint64_t{1} << (bits*level)) - 1))
+          continue;
+        auto &slot = wheel[level][(current >> (bits*level)) & (slots - 1)];
+        auto timers = std::move(slot);
+        slot.clear();
+        for (auto &timer : timers)
+          place(std::move(timer));
+      }
+
+      // what is in the slot of this tick is due (except for timers too far
+      // away to fit the wheel, which go around once more)
+      auto &slot = wheel[0][current & (slots - 1)];
+      auto timers = std::move(slot);
+      slot.clear();
+      for (auto &timer : timers) {
+        if (timer.due > current)
+          place(std::move(timer));
+        else {
+          expired.push_back(std::move(timer.task));
+          --count;
+        }
+      }
+    }
+    // with nothing left, the wheel is simply at the present
+    if (!count)
+      current = max(current, ticks(now));
+  }
+
+  TimerWheel::clock::time_point TimerWheel::next() const {
+    if (!count)
+      return clock::time_point::max();
+
+    // the first slot with something ahead in each level, a whole
+    // revolution around, and the earliest of them all
+    uint64_t first = ~uint64_t{0};
+    for (size_t level{0}; level < levels; ++level) {
+      uint64_t base = current >> (bits*level);
+      for (uint64_t k{1}; k <= slots; ++k)
+        if (!wheel[level][(base + k) & (slots - 1)].empty()) {
+          first = min(first, (base + k) << (bits*level));
+          break;
+        }
+    }
+    return start + first * tick;
+  }
+
+  void TimerWheel::clear(vector<Task> &taken) {
+    for (auto &level : wheel)
+      for (auto &slot : level) {
+        for (auto &timer : slot)
+          taken.push_back(std::move(timer.task));
+        slot.clear();
+      }
+    count = 0;
+  }
+
+  uint64_t TimerWheel::ticks(clock::time_point when) const {
+    return when <= start ? 0 : (when - start) / tick;
+  }
+
+  void TimerWheel::place(Timer &&timer) {
+    // the lowest level whose revolution reaches the tick, those too far
+    // away wait in the highest level as far as it goes
+    uint64_t distance = timer.due - current;
+    size_t   level{0};
+    while (level + 1 < levels && distance >= uint64_t{1} << (bits*(level + 1)))
+      ++level;
+    uint64_t due = min(timer.due, current + (uint64_t{1} << (bits*levels)) - 1);
+    wheel[level][(due >> (bits*level)) & (slots - 1)].push_back(
+      std::move(timer));
+  }
+
+}
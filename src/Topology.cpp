@@ -0,0 +1,158 @@
+#include "Topology.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+using namespace std;
+
+namespace ThreadPool {
+
+  // parse a sysfs list of cpus, e.g. "0-3,8,10-11"
+  static vector<int> parse_list(string const &list) {
+    vector<int> ids;
+    size_t position{0};
+    while (position < list.size()) {
+      size_t end = list.find(',', position);
+      if (end == string::npos)
+        end = list.size();
+      auto range = list.substr(position, end - position);
+      try {
+        size_t dash = range.find('-');
+        int first = stoi(range);
+        int last  = dash == string::npos ? first : stoi(range.substr(dash+1));
+        for (int id = first; id <= last; ++id)
+          ids.push_back(id);
+      }
+      catch (...) {
+        // not a number, e.g. an empty line
+      }
+      position = end + 1;
+    }
+    return ids;
+  }
+
+  // read the first line of a sysfs file, empty if it doesn't exist
+  static string read_line(filesystem::path const &path) {
+    string line;
+    ifstream file{path};
+    getline(file, line);
+    return line;
+  }
+
+  vector<Cpu> topology() {
+    // cpus we are allowed to run on, or simply all of them
+    vector<Cpu> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    if (!sched_getaffinity(0, sizeof(set), &set))
+      for (int id{0}; id < CPU_SETSIZE; ++id)
+        if (CPU_ISSET(id, &set))
+          cpus.push_back({id, id, 0});
+#endif
+    if (cpus.empty())
+      for (int id{0}; id < int(thread::hardware_concurrency()); ++id)
+        cpus.push_back({id, id, 0});
+
+    // hyperthreads of a core share the lowest id among them as core id
+    filesystem::path const sysfs{"/sys/devices/system"};
+    for (auto &cpu : cpus) {
+      auto siblings = parse_list(read_line(sysfs / "cpu" /
+        ("cpu" + to_string(cpu.id)) / "topology" / "thread_siblings_list"));
+      if (!siblings.empty())
+        cpu.core = *min_element(siblings.begin(), siblings.end());
+    }
+
+    // every node lists its own cpus
+    error_code error;
+    for (auto &entry : filesystem::directory_iterator{sysfs/"node", error}) {
+      auto name = entry.path().filename().string();
+      if (name.size() < 5 || name.compare(0, 4, "node") ||
+          !all_of(name.begin() + 4, name.end(), ::isdigit))
+        continue;
+      int node = stoi(name.substr(4));
+      for (int id : parse_list(read_line(entry.path() / "cpulist")))
+        for (auto &cpu : cpus)
+          if (cpu.id == id)
+            cpu.node = node;
+    }
+
+    return cpus;
+  }
+
+  vector<Cpu> placement(size_t n, Affinity const &affinity) {
+    if (affinity.mode == Affinity::Free || !n)
+      return {};
+
+    auto cpus = topology();
+    vector<Cpu> order;
+
+    // requested cpus in the requested order (if we are allowed to use them)
+    if (affinity.mode == Affinity::Cpus) {
+      if (affinity.cpus.empty())
+        order = cpus;
+      for (int id : affinity.cpus)
+        for (auto &cpu : cpus)
+          if (cpu.id == id)
+            order.push_back(cpu);
+    }
+
+    // first hyperthread of every core, then the second of every core...
+    else {
+      vector<Cpu> rest = cpus;
+      while (!rest.empty()) {
+        vector<Cpu> later;
+        vector<int> taken;
+        for (auto &cpu : rest)
+          if (find(taken.begin(), taken.end(), cpu.core) == taken.end()) {
+            taken.push_back(cpu.core);
+            order.push_back(cpu);
+          }
+          else
+            later.push_back(cpu);
+        rest = move(later);
+      }
+    }
+
+    if (order.empty())
+      return {};
+
+    // one cpu per worker (reusing them if there are more workers than cpus)
+    // and workers of a node next to each other
+    vector<Cpu> chosen;
+    for (size_t i{0}; i < n; ++i)
+      chosen.push_back(order[i % order.size()]);
+    stable_sort(chosen.begin(), chosen.end(), [](auto &a, auto &b) {
+      return a.node < b.node;
+    });
+    return chosen;
+  }
+
+  bool pin(int cpu) {
+#ifdef __linux__
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+      return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return !sched_setaffinity(0, sizeof(set), &set);
+#else
+    return false;
+#endif
+  }
+
+  int current_cpu() {
+#ifdef __linux__
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+  }
+
+}
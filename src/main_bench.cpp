@@ -0,0 +1,668 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <fcntl.h>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <streambuf>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "Progress.hpp"
+#include "ThreadPool.hpp"
+#include "ThreadPool_Bars.hpp"
+#include "ThreadPool_Channel.hpp"
+#include "ThreadPool_Coroutine.hpp"
+#include "ThreadPool_Graph.hpp"
+
+// Benchmarks for the thread pool and the progress bars.  Run 'bench' to run
+// all of them or 'bench name...' to run some, every result is printed as a
+// single JSON object per line, so it can be collected and compared between
+// versions, e.g. 'bin/bench throughput latency > results.jsonl'.
+
+using clock_type = std::chrono::steady_clock;
+
+// count every allocation made through the global operator new, so that the
+// cost of creating and queueing tasks can be measured directly
+std::atomic<long> allocations{0};
+
+void* operator new(size_t size) {
+  ++allocations;
+  if (void *ptr = std::malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc{};
+}
+
+void operator delete(void *ptr) noexcept {std::free(ptr);}
+void operator delete(void *ptr, size_t) noexcept {std::free(ptr);}
+
+// Report
+//
+// One result printed as a single JSON line once the object goes out of
+// scope, e.g. Report{"name"}("key", value)("other", "text");
+class Report {
+ public:
+  Report(std::string_view bench) {line << "{\"bench\":\"" << bench << '"';}
+  ~Report() {std::cout << line.str() << '}' << std::endl;}
+
+  Report& operator() (std::string_view key, std::string_view value) {
+    line << ",\"" << key << "\":\"" << value << '"';
+    return *this;
+  }
+
+  Report& operator() (std::string_view key, double value) {
+    line << ",\"" << key << "\":" << value;
+    return *this;
+  }
+
+ private:
+  std::ostringstream line;
+};
+
+// Silence
+//
+// Redirect the standard output to /dev/null while in scope, so that the
+// bars can be drawn without messing up the results.
+class Silence {
+ public:
+  Silence() : saved{dup(STDOUT_FILENO)} {
+    std::cout.flush();
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+  }
+
+  ~Silence() {
+    std::cout.flush();
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+  }
+
+ private:
+  int saved;
+};
+
+// seconds elapsed while executing function()
+template<typename F>
+double timeit(F &&function) {
+  auto start = clock_type::now();
+  function();
+  return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+// thread counts to measure: powers of 2 up to the hardware (at least 2)
+std::vector<size_t> thread_counts() {
+  size_t hardware = std::max(2u, std::thread::hardware_concurrency());
+  std::vector<size_t> counts;
+  for (size_t n{1}; n < hardware; n *= 2)
+    counts.push_back(n);
+  counts.push_back(hardware);
+  return counts;
+}
+
+// cheap busy work that the compiler can't optimize away
+inline unsigned long work(unsigned long x) {
+  return x * 6364136223846793005ul + 1442695040888963407ul;
+}
+std::atomic<unsigned long> sink{0};
+
+// allocations per task: the old way of wrapping tasks, execute() and post()
+void bench_allocations(long ntasks=100000) {
+  using namespace std;
+  using namespace ThreadPool;
+
+  // small lambda with a few captures, typical of real code
+  atomic<long> sum{0};
+  long a{1}, b{2}, c{3};
+  auto task = [&sum, a, b, c]() {sum += a + b + c; return a;};
+
+  // reference: a packaged_task<R()> moved into a packaged_task<void()>, as
+  // tasks used to be stored in the queue (no pool involved)
+  long before = allocations;
+  for (long i{0}; i < ntasks; ++i) {
+    packaged_task<long()> typed{task};
+    auto future = typed.get_future();
+    packaged_task<void()> erased{move(typed)};
+    erased();
+  }
+  double legacy = double(allocations - before) / ntasks;
+  Report{"allocations"}("variant", "packaged_task<void()>")("tasks", ntasks)
+    ("allocs_per_task", legacy);
+
+  // warm up the pool so that the worker queues are already allocated
+  Pool pool{1};
+  for (long i{0}; i < ntasks; ++i)
+    pool.post(task);
+  pool.wait();
+
+  before = allocations;
+  for (long i{0}; i < ntasks; ++i)
+    pool.execute(task);
+  pool.wait();
+  double execute = double(allocations - before) / ntasks;
+  Report{"allocations"}("variant", "execute")("tasks", ntasks)
+    ("allocs_per_task", execute);
+
+  before = allocations;
+  for (long i{0}; i < ntasks; ++i)
+    pool.post(task);
+  pool.wait();
+  double post = double(allocations - before) / ntasks;
+  Report{"allocations"}("variant", "post")("tasks", ntasks)
+    ("allocs_per_task", post);
+
+  // results through a channel instead of futures, once its buffer is warm
+  Channel<long> channel{pool};
+  for (long i{0}; i < ntasks; ++i)
+    channel.post(task);
+  while (channel.receive());
+
+  before = allocations;
+  for (long i{0}; i < ntasks; ++i)
+    channel.post(task);
+  while (channel.receive());
+  double streamed = double(allocations - before) / ntasks;
+  Report{"allocations"}("variant", "channel")("tasks", ntasks)
+    ("allocs_per_task", streamed);
+}
+
+// throughput of empty tasks submitted from outside the pool
+void bench_throughput(long ntasks=200000) {
+  using namespace std;
+  using namespace ThreadPool;
+
+  auto empty = []() {};
+  vector<int> items(ntasks);
+
+  for (size_t nthreads : thread_counts()) {
+    Pool pool{nthreads};
+    map<string_view, function<void()>> variants{
+      {"post",       [&]() {
+        for (long i{0}; i < ntasks; ++i)
+          pool.post(empty);
+      }},
+      {"execute",    [&]() {
+        for (long i{0}; i < ntasks; ++i)
+          pool.execute(empty);
+      }},
+      {"post_batch", [&]() {pool.post_batch(items, [](int) {});}},
+    };
+    for (auto &[variant, submit] : variants) {
+      double seconds = timeit([&]() {submit(); pool.wait();});
+      Report{"throughput"}("variant", variant)("threads", nthreads)
+        ("tasks", ntasks)("ns_per_task", 1e9 * seconds / ntasks)
+        ("tasks_per_sec", ntasks / seconds);
+    }
+  }
+}
+
+// latency from submission to the start of a task in an idle pool
+void bench_latency(long nsamples=2000) {
+  using namespace std;
+  using namespace ThreadPool;
+
+  for (size_t nthreads : thread_counts()) {
+    Pool pool{nthreads};
+    vector<double> latencies(nsamples);
+    for (auto &latency : latencies) {
+      atomic<bool> started{false};
+      auto submit = clock_type::now();
+      pool.post([&]() {
+        latency = chrono::duration<double>(clock_type::now() - submit).count();
+        started = true;
+        started.notify_one();
+      });
+      started.wait(false);
+      pool.wait();
+    }
+
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+      return 1e9 * latencies[min<size_t>(nsamples - 1, p * nsamples)];
+    };
+    Report{"latency"}("threads", nthreads)("samples", nsamples)
+      ("p50_ns", percentile(0.50))("p90_ns", percentile(0.90))
+      ("p99_ns", percentile(0.99))("max_ns", percentile(1.0));
+  }
+}
+
+// trade-off of the idle policies: submit-to-start latency of a task coming
+// after a pause, against the cpu burnt by the workers waiting for it
+void bench_idle(long nsamples=2000, long pause_us=50) {
+  using namespace std;
+  using namespace ThreadPool;
+
+  auto cpu_time = []() {
+    timespec time;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+    return time.tv_sec + 1e-9 * time.tv_nsec;
+  };
+
+  map<string_view, Idle> policies{
+    {"park",       {0, 0}},
+    {"spin",       {256, 0}},
+    {"spin_yield", {256, 256}},
+    {"spin_long",  {1l<<16, 0}},
+  };
+  for (auto &[policy, idle] : policies) {
+    Pool pool{min<size_t>(4, thread_counts().back())};
+    pool.set_idle(idle);
+    vector<double> latencies(nsamples);
+    double cpu = cpu_time();
+    double seconds = timeit([&]() {
+      for (auto &latency : latencies) {
+        this_thread::sleep_for(chrono::microseconds{pause_us});
+        atomic<bool> started{false};
+        auto submit = clock_type::now();
+        pool.post([&]() {
+          latency = chrono::duration<double>(clock_type::now() - submit)
+                      .count();
+          started = true;
+          started.notify_one();
+        });
+        started.wait(false);
+      }
+      pool.wait();
+    });
+    cpu = cpu_time() - cpu;
+
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+      return 1e9 * latencies[min<size_t>(nsamples - 1, p * nsamples)];
+    };
+    Report{"idle"}("policy", policy)("spins", idle.spins)
+      ("yields", idle.yields)("threads", pool.size())("pause_us", pause_us)
+      ("p50_ns", percentile(0.50))("p99_ns", percentile(0.99))
+      ("cpu_per_wall", cpu / seconds);
+  }
+}
+
+// lateness of delayed tasks (how long after their time they start), with
+// the pool idle or with its workers busy with short tasks
+void bench_timers(long ntimers=2000, long spread_ms=200) {
+  using namespace std;
+  using namespace ThreadPool;
+
+  for (bool busy : {false, true}) {
+    Pool pool{min<size_t>(4, thread_counts().back())};
+    // busy workers run short tasks, each queueing the next as it finishes
+    // (a copy, 'task' stays in place), counted to show they really ran
+    atomic<bool> stop{false};
+    atomic<long> executed{0};
+    function<void()> task = [&]() {
+      unsigned long x{0};
+      for (long i{0}; i < 1000; ++i)
+        x = work(x);
+      sink += x;
+      executed.fetch_add(1, memory_order_relaxed);
+      if (!stop)
+        pool.post(task);
+    };
+    if (busy)
+      for (size_t i{0}; i < pool.size(); ++i)
+        pool.post(task);
+
+    vector<double> lateness(ntimers);
+    vector<future<void>> futures;
+    for (long i{0}; i < ntimers; ++i) {
+      auto delay = chrono::microseconds{(i * 7919 % ntimers) * 1000 *
+                                        spread_ms / ntimers};
+      auto due   = clock_type::now() + delay;
+      futures.push_back(pool.execute_after(delay, [&lateness, i, due]() {
+        lateness[i] = chrono::duration<double>(clock_type::now() - due)
+                        .count();
+      }));
+    }
+    for (auto &future : futures)
+      future.get();
+    stop = true;
+    pool.wait();
+
+    sort(lateness.begin(), lateness.end());
+    auto percentile = [&](double p) {
+      return 1e6 * lateness[min<size_t>(ntimers - 1, p * ntimers)];
+    };
+    Report{"timers"}("workers", busy ? "busy" : "idle")
+      ("threads", pool.size())("timers", ntimers)("spread_ms", spread_ms)
+      ("busy_tasks", executed.load())("p50_us", percentile(0.50))
+      ("p99_us", percentile(0.99))("max_us", percentile(1.0));
+  }
+}
+
+// strong scaling of split() and parallel_for() for a fixed amount of work
+void bench_split(long n=1l<<26) {
+  using namespace std;
+  using namespace ThreadPool;
+
+  auto part = [](long n) {
+    unsigned long x{0};
+    while (n --> 0)
+      x = work(x);
+    sink += x;
+  };
+  auto chunk = [&part](long begin, long end) {part(end - begin);};
+
+  map<string_view, double> serial;
+  for (size_t nthreads : thread_counts()) {
+    Pool pool{nthreads};
+    map<string_view, function<void()>> variants{
+      {"split",        [&]() {for (auto &f : pool.split(part, n)) f.get();}},
+      {"parallel_for", [&]() {pool.parallel_for(0, n, chunk);}},
+    };
+    for (auto &[variant, run] : variants) {
+      double seconds = timeit(run);
+      if (!serial.count(variant))
+        serial[variant] = seconds;
+      Report{"split"}("variant", variant)("threads", nthreads)("n", n)
+        ("seconds", seconds)("speedup", serial[variant] / seconds);
+    }
+  }
+}
+
+// cost per task of a Graph run against the same tasks posted directly: a
+// fan-out (one task and all the others after it) and a chain (every task
+// after the previous one, nothing to run in parallel)
+void bench_graph(long ntasks=20000, long rounds=10) {
+  using namespace std;
+  using namespace ThreadPool;
+
+  auto task = []() {sink += 1;};
+  for (size_t nthreads : thread_counts()) {
+    Pool pool{nthreads};
+
+    Graph fanout{pool};
+    auto first = fanout.add(task);
+    for (long i{1}; i < ntasks; ++i)
+      first.then(task);
+
+    Graph chain{pool};
+    auto node = chain.add(task);
+    for (long i{1}; i < ntasks; ++i)
+      node = node.then(task);
+
+    auto run = [&](Graph &graph) {
+      for (long r{0}; r < rounds; ++r) {
+        graph.run();
+        graph.wait();
+      }
+    };
+    map<string_view, function<void()>> variants{
+      {"post",   [&]() {
+        for (long r{0}; r < rounds; ++r) {
+          for (long i{0}; i < ntasks; ++i)
+            pool.post(task);
+          pool.wait();
+        }
+      }},
+      {"fanout", [&]() {run(fanout);}},
+      {"chain",  [&]() {run(chain);}},
+    };
+    for (auto &[variant, submit] : variants) {
+      double seconds = timeit(submit);
+      Report{"graph"}("variant", variant)("threads", nthreads)
+        ("tasks", ntasks)("rounds", rounds)
+        ("ns_per_task", 1e9 * seconds / (ntasks * rounds));
+    }
+  }
+}
+
+// coroutine going through the pool n times, one task each time
+ThreadPool::Coroutine<long> hops(ThreadPool::Pool &pool, long n) {
+  for (long i{0}; i < n; ++i)
+    co_await pool.schedule();
+  co_return n;
+}
+
+// coroutine awaiting n others in turn, all on the same thread
+ThreadPool::Coroutine<long> one() {co_return 1;}
+ThreadPool::Coroutine<long> nested(long n) {
+  long sum{0};
+  for (long i{0}; i < n; ++i)
+    sum += co_await one();
+  co_return sum;
+}
+
+// cost of a coroutine moving to the pool with 'co_await pool.schedule()',
+// against a task posting the next one, and of awaiting a Coroutine<T>
+void bench_coroutine(long nhops=200000) {
+  using namespace std;
+  using namespace ThreadPool;
+
+  for (size_t nthreads : thread_counts()) {
+    Pool pool{nthreads};
+    // each hop posts a new task calling the same function again
+    long left;
+    function<void()> hop = [&]() {
+      if (--left > 0)
+        pool.post([&hop]() {hop();});
+    };
+    map<string_view, function<void()>> variants{
+      {"post",     [&]() {
+        left = nhops;
+        pool.post([&hop]() {hop();});
+        pool.wait();
+      }},
+      {"schedule", [&]() {
+        sink += spawn(pool, hops(pool, nhops)).get();
+      }},
+      {"await",    [&]() {
+        sink += spawn(pool, nested(nhops)).get();
+      }},
+    };
+    for (auto &[variant, run] : variants) {
+      double seconds = timeit(run);
+      Report{"coroutine"}("variant", variant)("threads", nthreads)
+        ("hops", nhops)("ns_per_hop", 1e9 * seconds / nhops);
+    }
+  }
+}
+
+// overhead of measuring task times with enable_stats(), plus the resulting
+// queue wait and run time percentiles of those same empty tasks
+void bench_stats(long ntasks=200000) {
+  using namespace std;
+  using namespace ThreadPool;
+
+  vector<int> items(ntasks);
+  for (size_t nthreads : thread_counts())
+    for (bool measure : {false, true}) {
+      Pool pool{nthreads};
+      pool.enable_stats(measure);
+      double seconds = timeit([&]() {
+        for (int i : items)
+          pool.post([i]() {sink += i;});
+        pool.wait();
+      });
+      auto stats = pool.stats();
+      double busy{0}, idle{0};
+      for (auto &worker : stats.workers) {
+        busy += worker.busy.count();
+        idle += worker.idle.count();
+      }
+      Report{"stats"}("variant", measure ? "measured" : "counted")
+        ("threads", nthreads)("tasks", ntasks)
+        ("ns_per_task", 1e9 * seconds / ntasks)
+        ("contended", stats.contended)("busy_s", busy)("idle_s", idle)
+        ("helped", stats.helped)("helping_s", stats.helping.count())
+        ("wait_p50_ns", stats.wait.percentile(0.50))
+        ("wait_p99_ns", stats.wait.percentile(0.99))
+        ("run_p99_ns", stats.run.percentile(0.99));
+    }
+}
+
+// overhead of tracking tasks with Bars, incrementing the counter of each
+// task once every 'every' iterations of (cheap) work
+void bench_bars(long ntasks=64, long iterations=1l<<20) {
+  using namespace std;
+  using namespace ThreadPool;
+
+  for (long every : {1l, 100l, 10000l}) {
+    Pool pool{};
+    auto run = [&](auto &&task) {
+      return timeit([&]() {
+        for (long i{0}; i < ntasks; ++i)
+          pool.post(task);
+        pool.wait();
+      });
+    };
+
+    // the same loop of work, with or without a counter being incremented
+    auto loop = [&](auto &&increment) {
+      unsigned long x{0};
+      for (long i{0}; i < iterations; i += every) {
+        for (long j{0}; j < every; ++j)
+          x = work(x);
+        increment();
+      }
+      sink += x;
+    };
+
+    // no tracking at all: the work alone
+    double none = run([&]() {loop([]() {});});
+
+    // tracking with bars drawn on a (silenced) terminal
+    double tracked;
+    {
+      Silence _;
+      Bars bars{pool, {.mode = Refresh::Terminal}};
+      tracked = run([&]() {
+        auto &c = bars.new_counter(iterations / every);
+        loop([&c]() {++c;});
+      });
+      bars.wait();
+    }
+
+    for (auto [variant, seconds] : {pair{"none", none}, {"bars", tracked}})
+      Report{"bars"}("variant", variant)("increment_every", every)
+        ("tasks", ntasks)("ns_per_task", 1e9 * seconds / ntasks)
+        ("overhead", seconds / none - 1);
+  }
+}
+
+// stream buffer that sends every line to a file descriptor with a write(),
+// as the standard output does when connected to a terminal
+class LineBuffer : public std::streambuf {
+ public:
+  LineBuffer(int fd) : fd{fd}, written{0}, writes{0} {}
+
+  size_t bytes () const {return written;}
+  size_t calls () const {return writes;}
+
+ protected:
+  int overflow(int c) override {
+    if (c != EOF)
+      line += char(c);
+    if (c == '\n')
+      sync();
+    return c;
+  }
+
+  std::streamsize xsputn(char const *s, std::streamsize n) override {
+    for (std::streamsize i{0}; i < n; ++i)
+      overflow(s[i]);
+    return n;
+  }
+
+  int sync() override {
+    if (!line.empty()) {
+      written += ::write(fd, line.data(), line.size());
+      ++writes;
+      line.clear();
+    }
+    return 0;
+  }
+
+ private:
+  int         fd;
+  std::string line;
+  size_t      written, writes;
+};
+
+// cost of drawing frames of many bars: full redraw line by line (as Bars
+// used to do) against the diff-based Progress::Screen
+void bench_render(long frames=2000, long bars=64) {
+  using namespace std;
+  using namespace Progress;
+
+  // every bar advances at its own pace, so only some of them change
+  auto fraction = [](long frame, long bar) {
+    return min(1.0, frame * (1 + bar%7) / 4000.0);
+  };
+  auto report = [&](string_view variant, size_t bytes, size_t writes,
+                    double seconds) {
+    Report{"render"}("variant", variant)("frames", frames)("bars", bars)
+      ("bytes_per_frame", double(bytes) / frames)
+      ("writes_per_frame", double(writes) / frames)
+      ("ns_per_frame", 1e9 * seconds / frames);
+  };
+  int devnull = open("/dev/null", O_WRONLY);
+
+  {
+    LineBuffer buffer{devnull};
+    auto *old = cout.rdbuf(&buffer);
+    double seconds = timeit([&]() {
+      for (long f{0}; f < frames; ++f) {
+        for (long b{0}; b < bars; ++b)
+          Bar(fraction(f, b)) << "task number " << b << endl;
+        cout << "\33[" << bars << 'F' << flush;
+      }
+    });
+    cout.rdbuf(old);
+    report("redraw", buffer.bytes(), buffer.calls(), seconds);
+  }
+
+  {
+    Screen screen{devnull};
+    double seconds = timeit([&]() {
+      for (long f{0}; f < frames; ++f) {
+        for (long b{0}; b < bars; ++b) {
+          auto &line = screen.line();
+          Bar(line, fraction(f, b));
+          line += "task number " + to_string(b);
+        }
+        screen.draw();
+      }
+    });
+    report("screen", screen.bytes(), screen.calls(), seconds);
+  }
+
+  close(devnull);
+}
+
+int main(int argc, char *argv[]) {
+  std::map<std::string_view, std::function<void()>> benches{
+    {"allocations", []() {bench_allocations();}},
+    {"throughput",  []() {bench_throughput();}},
+    {"latency",     []() {bench_latency();}},
+    {"idle",        []() {bench_idle();}},
+    {"timers",      []() {bench_timers();}},
+    {"split",       []() {bench_split();}},
+    {"graph",       []() {bench_graph();}},
+    {"coroutine",   []() {bench_coroutine();}},
+    {"stats",       []() {bench_stats();}},
+    {"bars",        []() {bench_bars();}},
+    {"render",      []() {bench_render();}},
+  };
+
+  // run the benchmarks given as arguments, or all of them
+  if (argc == 1)
+    for (auto &[name, bench] : benches)
+      bench();
+  for (int i{1}; i < argc; ++i) {
+    if (!benches.count(argv[i])) {
+      std::cerr << "unknown benchmark '" << argv[i] << "', choose from:";
+      for (auto &[name, bench] : benches)
+        std::cerr << ' ' << name;
+      std::cerr << std::endl;
+      return 1;
+    }
+    benches[argv[i]]();
+  }
+  return 0;
+}